@@ -0,0 +1,456 @@
+// Micro-benchmarks for the Core library. Predictions and the oscillation
+// calculator are synthetic in-memory stand-ins, so this runs anywhere
+// without CAF files. For each call it reports the mean latency and the
+// number of heap allocations. It also reports how far reduced-precision
+// tensors deviate from double precision, checks concurrent predictions on
+// a shared Sample agree with serial ones, and checks likelihood gradients
+// against finite differences
+
+#include "Core/Ensemble.h"
+#include "Core/Likelihood.h"
+#include "Core/OscCalcPool.h"
+#include "Core/PredictionTensor.h"
+#include "Core/Sample.h"
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/HistAxis.h"
+#include "CAFAna/Core/ISyst.h"
+#include "CAFAna/Core/Var.h"
+
+#include "TMD5.h"
+
+#include "tbb/parallel_for.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+  std::atomic<size_t> gAllocs(0);
+
+} // anonymous namespace
+
+// Count every heap allocation in the process
+void* operator new(size_t n)
+{
+  ++gAllocs;
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace pisces {
+
+  using namespace ana;
+
+  const int kNBins = 50;
+
+  /// Oscillation probabilities with a cheap closed form, so the benchmarks
+  /// measure our code rather than the calculator
+  class BenchCalc : public osc::IOscCalc {
+  public:
+    using osc::IOscCalc::P;
+    BenchCalc(double amp=0.1) : fAmp(amp) {};
+    virtual BenchCalc* Copy() const override { return new BenchCalc(*this); };
+    virtual double P(int from, int to, double E) override
+    {
+      double p = fAmp / (1 + E*E);
+      return from == to ? 1 - p : p;
+    };
+    /// Hashable, so predictions with it go through the caches
+    virtual TMD5* GetParamsHash() const override
+    {
+      TMD5* ret = new TMD5;
+      ret->Update((const unsigned char*)&fAmp, sizeof(fAmp));
+      ret->Final();
+      return ret;
+    };
+  protected:
+    double fAmp;
+  }; // class BenchCalc
+
+  /// Adjustable calculator with the same form as BenchCalc, with th23 as
+  /// the amplitude and dmsq32 setting the falloff, for checking gradients
+  template<class T> class BenchCalcAdj : public osc::_IOscCalcAdjustable<T> {
+  public:
+    using osc::_IOscCalc<T>::P;
+    BenchCalcAdj(double th23, double dmsq32)
+    {
+      this->fL = this->fRho = 0;
+      this->fDmsq21 = this->fTh12 = this->fTh13 = this->fdCP = 0;
+      this->fTh23 = th23;
+      this->fDmsq32 = dmsq32;
+    };
+    virtual BenchCalcAdj* Copy() const override { return new BenchCalcAdj(*this); };
+    virtual T P(int from, int to, double E) override
+    {
+      T p = 0.2 * this->fTh23 / (1 + 400 * this->fDmsq32 * E);
+      return from == to ? 1 - p : p;
+    };
+    virtual void SetL     (double L)        override { this->fL      = L; };
+    virtual void SetRho   (double rho)      override { this->fRho    = rho; };
+    virtual void SetDmsq21(const T& dmsq21) override { this->fDmsq21 = dmsq21; };
+    virtual void SetDmsq32(const T& dmsq32) override { this->fDmsq32 = dmsq32; };
+    virtual void SetTh12  (const T& th12)   override { this->fTh12   = th12; };
+    virtual void SetTh13  (const T& th13)   override { this->fTh13   = th13; };
+    virtual void SetTh23  (const T& th23)   override { this->fTh23   = th23; };
+    virtual void SetdCP   (const T& dCP)    override { this->fdCP    = dCP; };
+  }; // class BenchCalcAdj
+
+  /// Syst with no effect on events, only used as a key in SystShifts
+  class BenchSyst : public ISyst {
+  public:
+    BenchSyst(const std::string& name) : ISyst(name, name) {};
+    virtual void Shift(double, caf::SRProxy*, double&) const override {};
+  }; // class BenchSyst
+
+  /// Flat per-channel spectra, oscillated at the bin centres and scaled by
+  /// the summed shifts
+  class BenchPrediction : public IPrediction {
+  public:
+
+    BenchPrediction(const Sample& s)
+      : fSample(s), fCentres(kNBins)
+    {
+      for (int i = 0; i < kNBins; ++i) fCentres(i) = (i + 0.5) * 10. / kNBins;
+    };
+
+    virtual Spectrum Predict(osc::IOscCalc* calc) const override
+    {
+      return PredictComponent(calc, Flavors::kAll, Current::kBoth, Sign::kBoth);
+    };
+    virtual Spectrum PredictSyst(osc::IOscCalc* calc, const SystShifts& shifts) const override
+    {
+      return PredictComponentSyst(calc, shifts, Flavors::kAll, Current::kBoth, Sign::kBoth);
+    };
+    virtual Spectrum PredictComponent(osc::IOscCalc* calc, Flavors::Flavors_t flav,
+                                      Current::Current_t curr, Sign::Sign_t sign) const override
+    {
+      return PredictComponentSyst(calc, kNoShift, flav, curr, sign);
+    };
+    virtual Spectrum PredictSyst(osc::IOscCalcStan* calc, const SystShifts& shifts) const override
+    {
+      return PredictComponentSyst(calc, shifts, Flavors::kAll, Current::kBoth, Sign::kBoth);
+    };
+    /// As the plain version, keeping derivatives with respect to the
+    /// calculator's parameters and any autodiff shifts
+    virtual Spectrum PredictComponentSyst(osc::IOscCalcStan* calc, const SystShifts& shifts,
+                                          Flavors::Flavors_t flav, Current::Current_t curr,
+                                          Sign::Sign_t sign) const override
+    {
+      stan::math::var scale = 1;
+      for (const ISyst* syst : shifts.ActiveSysts())
+        scale += 0.01 * (shifts.HasStan(syst) ? shifts.GetShift<stan::math::var>(syst)
+                                              : stan::math::var(shifts.GetShift(syst)));
+      Eigen::ArrayXstan arr(kNBins+2);
+      arr.setZero();
+      for (const OscChannel& ch : fSample.AllChannels()) {
+        if (!((ch.Flav() & flav) && (ch.Curr() & curr) && (ch.Sign() & sign))) continue;
+        for (int i = 0; i < kNBins; ++i)
+          arr(i+1) += ch.Curr() == Current::kNC ? stan::math::var(1) : calc->P(ch.From(), ch.To(), fCentres(i));
+      }
+      Eigen::ArrayXstan ret = scale * arr;
+      return Spectrum(std::move(ret), fSample.GetAxis(), fSample.POT(), fSample.Livetime());
+    };
+    virtual Spectrum PredictComponentSyst(osc::IOscCalc* calc, const SystShifts& shifts,
+                                          Flavors::Flavors_t flav, Current::Current_t curr,
+                                          Sign::Sign_t sign) const override
+    {
+      double scale = 1;
+      for (const ISyst* syst : shifts.ActiveSysts()) scale += 0.01 * shifts.GetShift(syst);
+      Eigen::ArrayXd arr = Eigen::ArrayXd::Zero(kNBins);
+      for (const OscChannel& ch : fSample.AllChannels()) {
+        if (!((ch.Flav() & flav) && (ch.Curr() & curr) && (ch.Sign() & sign))) continue;
+        for (int i = 0; i < kNBins; ++i)
+          arr(i) += ch.Curr() == Current::kNC ? 1 : calc->P(ch.From(), ch.To(), fCentres(i));
+      }
+      return fSample.NewSpectrum(scale * arr);
+    };
+
+  protected:
+    Sample fSample;
+    Eigen::ArrayXd fCentres;
+  }; // class BenchPrediction
+
+  //---------------------------------------------------------------------------
+  /// Stop the optimiser discarding a result
+  template<class T> void Escape(const T& x)
+  {
+    asm volatile("" : : "g"(&x) : "memory");
+  } // function Escape
+
+  double gMinTime = 0.2; // seconds per benchmark
+
+  //---------------------------------------------------------------------------
+  template<class F> void Bench(const std::string& name, const std::string& config, F f)
+  {
+    f(); // warm up any lazy initialisation
+    typedef std::chrono::steady_clock Clock;
+    size_t calls = 0, allocs = gAllocs;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    do {
+      for (int i = 0; i < 16; ++i) f();
+      calls += 16;
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < gMinTime);
+    allocs = gAllocs - allocs;
+    printf("%-24s %-28s %12.1f ns %10.1f allocs\n", name.c_str(), config.c_str(),
+           1e9 * elapsed / calls, double(allocs) / calls);
+  } // function Bench
+
+  //---------------------------------------------------------------------------
+  /// Give s an axis, POT and stand-in prediction
+  void Setup(Sample& s)
+  {
+    s.SetAxis(HistAxis("Reco energy (GeV)", Binning::Simple(kNBins, 0, 10),
+                       Var([](const caf::SRProxy*) { return 0.; })));
+    s.SetPOT(1e21);
+    s.SetLivetime(0);
+    std::unique_ptr<IPrediction> pred(new BenchPrediction(s));
+    s.SetPrediction(pred);
+  } // function Setup
+
+  //---------------------------------------------------------------------------
+  /// Shifts with nSysts active systs, and aliases on s for every other one
+  SystShifts MakeShifts(const std::vector<std::unique_ptr<BenchSyst>>& systs,
+                        size_t nSysts, Sample& s)
+  {
+    SystShifts ret;
+    for (size_t i = 0; i < nSysts; ++i) {
+      ret.SetShift(systs[i].get(), 0.5);
+      if (i % 2) s.SetSystAlias(systs[i].get(), systs[systs.size()-1-i].get());
+    }
+    return ret;
+  } // function MakeShifts
+
+  //---------------------------------------------------------------------------
+  void BenchSample(Detector det, size_t nSysts,
+                   const std::vector<std::unique_ptr<BenchSyst>>& systs)
+  {
+    Sample s(kCCNumu, kFHC, det);
+    Setup(s);
+    SystShifts shifts = MakeShifts(systs, nSysts, s);
+    BenchCalc calc;
+    OscChannel chan = s.SignalChannels().front();
+    Eigen::ArrayXd buf(kNBins), arr = Eigen::ArrayXd::Ones(kNBins);
+
+    std::string config = s.DetStr()+" chan="+std::to_string(s.AllChannels().size())
+      +" systs="+std::to_string(nSysts);
+    Bench("Predict",            config, [&]() { Escape(s.Predict(&calc, shifts)); });
+    Bench("PredictChannel",     config, [&]() { Escape(s.PredictChannel(chan, &calc, shifts)); });
+    Bench("PredictSignal",      config, [&]() { Escape(s.PredictSignal(&calc, shifts)); });
+    Bench("PredictAllChannels", config, [&]() { Escape(s.PredictAllChannels(&calc, shifts)); });
+    Bench("PredictInto",        config, [&]() { s.PredictInto(buf, &calc, shifts); Escape(buf); });
+    Bench("Shifts",             config, [&]() { Escape(s.Shifts(shifts)); });
+    Bench("AllChannels",        config, [&]() { Escape(s.AllChannels()); });
+    Bench("NewSpectrum",        config, [&]() { Escape(s.NewSpectrum(arr)); });
+  } // function BenchSample
+
+  //---------------------------------------------------------------------------
+  void BenchEnsemble(size_t nSamples)
+  {
+    std::vector<Sample> all = Sample::All();
+    std::vector<Sample> samples(all.begin(), all.begin() + nSamples);
+    for (Sample& s : samples) Setup(s);
+    Ensemble ens(samples);
+    BenchCalc calc;
+    Eigen::ArrayXd buf(ens.NBins());
+
+    std::string config = "samples="+std::to_string(nSamples);
+    Bench("Ensemble::Predict",     config, [&]() { Escape(ens.Predict(&calc)); });
+    Bench("Ensemble::PredictInto", config, [&]() { ens.PredictInto(buf, &calc); Escape(buf); });
+    Bench("EnsembleID round-trip", config, [&]() {
+      Escape(Sample::FromEnsembleID(Sample::EnsembleID(samples)));
+    });
+  } // function BenchEnsemble
+
+  //---------------------------------------------------------------------------
+  /// Ensemble of tensor-backed samples, whose nominal PredictInto should
+  /// make no heap allocations once its workspace exists
+  void BenchTensorEnsemble(size_t nSamples)
+  {
+    std::vector<Sample> all = Sample::All();
+    std::vector<Sample> samples(all.begin(), all.begin() + nSamples);
+    for (Sample& s : samples) {
+      Setup(s);
+      std::vector<Eigen::MatrixXd> responses(s.AllChannels().size(),
+                                             Eigen::MatrixXd::Constant(kNBins, kNBins, 1));
+      std::unique_ptr<IPrediction> pred(new PredictionTensor(s, Binning::Simple(kNBins, 0, 10),
+                                                             responses, s.POT()));
+      s.SetPrediction(pred);
+    }
+    Ensemble ens(samples);
+    BenchCalc calc;
+    Eigen::ArrayXd buf(ens.NBins());
+
+    std::string config = "tensor samples="+std::to_string(nSamples);
+    Bench("Ensemble::PredictInto", config, [&]() { ens.PredictInto(buf, &calc); Escape(buf); });
+  } // function BenchTensorEnsemble
+
+  //---------------------------------------------------------------------------
+  /// Predict one cached sample from many threads at once, each with a clone
+  /// from the pool, and check every result against a serial reference
+  void CheckConcurrent(const std::vector<std::unique_ptr<BenchSyst>>& systs)
+  {
+    Sample s(kCCNue, kFHC, kFarDet);
+    Setup(s);
+    s.EnablePredictionCache(4);
+    BenchCalc calc;
+    const size_t nPoints = 16, nCalls = 1024;
+    std::vector<SystShifts> points(nPoints);
+    for (size_t p = 0; p < nPoints; ++p) points[p].SetShift(systs[p].get(), 0.5);
+
+    Eigen::ArrayXXd ref(kNBins, nPoints);
+    for (size_t p = 0; p < nPoints; ++p) ref.col(p) = s.ToArray(s.Predict(&calc, points[p]));
+
+    OscCalcPool calcs(&calc);
+    std::atomic<size_t> bad(0);
+    tbb::parallel_for(size_t(0), nCalls, [&](size_t i) {
+      const SystShifts& shifts = points[i % nPoints];
+      Eigen::ArrayXd buf(kNBins);
+      s.PredictInto(buf, calcs.Local(), shifts);
+      if (!(buf == ref.col(i % nPoints)).all()) ++bad;
+      if (!(s.ToArray(s.Predict(calcs.Local(), shifts)) == ref.col(i % nPoints)).all()) ++bad;
+    });
+    if (bad) Error(std::to_string(bad)+" concurrent predictions disagreed with the serial ones");
+    // The cache is smaller than the number of points, so it has to both
+    // hit and evict under contention
+    if (!s.CacheHits() || !s.CacheMisses())
+      Error("concurrent predictions didn't exercise the prediction cache");
+    printf("%-24s %-28s %12zu calls %10zu clones %10zu hits\n", "Concurrent Predict", "OK",
+           2*nCalls, calcs.NClones(), s.CacheHits());
+  } // function CheckConcurrent
+
+  //---------------------------------------------------------------------------
+  /// Check the autodiff gradient of the Poisson likelihood against finite
+  /// differences: central differences of Eval for the oscillation
+  /// parameters, and the chain rule through Ensemble::Jacobian for systs
+  void CheckGradient(const std::vector<std::unique_ptr<BenchSyst>>& systs)
+  {
+    Sample s(kCCNue, kFHC, kFarDet);
+    Setup(s);
+    // Data away from the prediction, so no derivative vanishes
+    BenchCalc dataCalc(0.3);
+    s.SetData(s.Predict(&dataCalc));
+    Ensemble ens({ s });
+    PoissonLikelihood like(ens);
+
+    const double th23 = 0.5, dmsq32 = 2.5e-3;
+    std::vector<const ISyst*> shifted = { systs[0].get(), systs[1].get() };
+    SystShifts shifts;
+    shifts.SetShift(shifted[0], 0.3);
+    shifts.SetShift(shifted[1], -0.2);
+
+    std::vector<StanOscParam> params = {
+      { [](const osc::IOscCalcAdjustableStan* c) { return c->GetTh23(); },
+        [](osc::IOscCalcAdjustableStan* c, const stan::math::var& v) { c->SetTh23(v); } },
+      { [](const osc::IOscCalcAdjustableStan* c) { return c->GetDmsq32(); },
+        [](osc::IOscCalcAdjustableStan* c, const stan::math::var& v) { c->SetDmsq32(v); } }
+    };
+    BenchCalcAdj<stan::math::var> stanCalc(th23, dmsq32);
+    Eigen::VectorXd grad;
+    double val = like.Gradient(&stanCalc, params, shifted, shifts, grad);
+
+    Eigen::VectorXd ref(grad.size());
+    for (size_t i = 0; i < params.size(); ++i) {
+      double x[2] = { th23, dmsq32 }, dx = 1e-6 * x[i];
+      x[i] += dx;
+      BenchCalcAdj<double> up(x[0], x[1]);
+      x[i] -= 2*dx;
+      BenchCalcAdj<double> down(x[0], x[1]);
+      ref(i) = (like.Eval(&up, shifts) - like.Eval(&down, shifts)) / (2*dx);
+    }
+    // d(-2 ln L)/de = 2 (1 - o/e) for each bin
+    BenchCalcAdj<double> calc(th23, dmsq32);
+    double refVal = like.Eval(&calc, shifts);
+    Eigen::VectorXd dLde = (2 * (1 - like.Observed() / like.Expected())).matrix();
+    ref.tail(shifted.size()) = ens.Jacobian(&calc, shifted, 0.1, shifts).transpose() * dLde;
+
+    double maxRel = ((grad - ref).array().abs() / ref.array().abs().max(1e-12)).maxCoeff();
+    if (maxRel > 1e-4 || std::abs(val - refVal) > 1e-8 * std::abs(refVal))
+      Error("likelihood gradient disagrees with finite differences");
+    printf("%-24s %-28s %12.2e rel %10zu params\n", "Gradient", "OK", maxRel, size_t(grad.size()));
+  } // function CheckGradient
+
+  //---------------------------------------------------------------------------
+  /// Tensor predictions at each storage precision: latency, memory, and the
+  /// largest deviation from the double-precision reference
+  void BenchPrecision(size_t nTrue)
+  {
+    Sample s(kCCNue, kFHC, kFarDet);
+    Setup(s);
+    // Smooth, strictly positive responses spanning a few orders of magnitude
+    std::vector<Eigen::MatrixXd> responses;
+    for (size_t c = 0; c < s.AllChannels().size(); ++c) {
+      Eigen::MatrixXd r(kNBins, nTrue);
+      for (int i = 0; i < kNBins; ++i)
+        for (size_t j = 0; j < nTrue; ++j)
+          r(i, j) = (c+1) * std::exp(-0.5*std::pow((i - j*double(kNBins)/nTrue) / 3., 2)) + 1e-3;
+      responses.push_back(r);
+    }
+    PredictionTensor ref(s, Binning::Simple(nTrue, 0, 10), responses, s.POT());
+
+    std::vector<std::unique_ptr<BenchCalc>> owned;
+    std::vector<osc::IOscCalc*> calcs;
+    for (double amp : { 0., 0.05, 0.1, 0.3, 0.6 }) {
+      owned.emplace_back(new BenchCalc(amp));
+      calcs.push_back(owned.back().get());
+    }
+    Eigen::MatrixXd w = ref.OscWeights(calcs[2]);
+    Eigen::ArrayXd buf(kNBins);
+
+    const char* names[] = { "double", "float", "int16" };
+    for (TensorPrecision p : { kDoublePrecision, kSinglePrecision, kQuantized16 }) {
+      PredictionTensor test(ref);
+      test.SetPrecision(p);
+      PrecisionReport rep = PredictionTensor::Compare(test, ref, calcs);
+      std::string config = "true="+std::to_string(nTrue)+" "+names[p];
+      Bench("Tensor::PredictInto", config, [&]() { test.PredictInto(buf, w, test.POT()); Escape(buf); });
+      printf("%-24s %-28s %12zu bytes %10.2e abs %10.2e rel\n", "Tensor precision",
+             config.c_str(), test.Bytes(), rep.maxAbs, rep.maxRel);
+    }
+  } // function BenchPrecision
+
+} // namespace pisces
+
+using namespace pisces;
+
+//-----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  if (argc > 2) Usage(argv, "[seconds per benchmark]");
+  if (argc == 2) gMinTime = std::atof(argv[1]);
+
+  std::vector<std::unique_ptr<BenchSyst>> systs;
+  for (size_t i = 0; i < 64; ++i)
+    systs.emplace_back(new BenchSyst("benchsyst"+std::to_string(i)));
+
+  for (Detector det : { kNearDet, kFarDet })
+    for (size_t nSysts : { 0, 8, 32 })
+      BenchSample(det, nSysts, systs);
+
+  for (size_t nSamples : { 1, 4, 10, 40 }) {
+    BenchEnsemble(nSamples);
+    BenchTensorEnsemble(nSamples);
+  }
+
+  for (size_t nTrue : { 50, 200 })
+    BenchPrecision(nTrue);
+
+  CheckConcurrent(systs);
+  CheckGradient(systs);
+
+  return 0;
+} // function main
@@ -0,0 +1,62 @@
+// End-to-end check of the file-backed work queue. Forks local workers
+// over a fresh queue in a temporary directory, with a partly written line
+// and results for tasks that don't exist planted in an extra shard, and
+// checks the merge holds exactly one correct result for every task
+
+#include "Core/WorkQueue.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+
+using namespace pisces;
+
+//-----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  if (argc > 3) Usage(argv, "[workers] [tasks]");
+  size_t nWorkers = argc > 1 ? std::atoi(argv[1]) : 4;
+  size_t nTasks   = argc > 2 ? std::atoi(argv[2]) : 200;
+
+  char tmpl[] = "/tmp/pisces_workqueue.XXXXXX";
+  if (!mkdtemp(tmpl)) Error("failed to create a temporary directory");
+  std::string dir = tmpl;
+  WorkQueue queue = WorkQueue::Create(dir+"/queue", "check", nTasks);
+
+  // Debris a crashed worker could leave behind, which the merge must skip.
+  // Named to sort first, so it would win if it were taken
+  {
+    std::ofstream junk(dir+"/queue/shards/0.junk");
+    junk << nTasks << "\tno such task\n" << "x\tnot a task\n" << "1\tcut sh";
+  }
+
+  size_t failed = queue.RunLocal(nWorkers, [](WorkQueue&, size_t task) {
+    return std::to_string(task*task);
+  });
+  if (failed) Error(std::to_string(failed)+" work queue workers failed");
+  if (queue.NDone() != nTasks) Error("work queue finished with tasks left undone");
+
+  std::map<size_t, std::string> merged = queue.Merge();
+  if (merged.size() != nTasks) Error("merged work queue has the wrong number of results");
+  for (const auto& [task, result] : merged)
+    if (result != std::to_string(task*task))
+      Error("merged work queue has the wrong result for task "+std::to_string(task));
+
+  // Merging twice must give the same file
+  queue.Merge(dir+"/a.txt");
+  queue.Merge(dir+"/b.txt");
+  std::ifstream a(dir+"/a.txt"), b(dir+"/b.txt");
+  std::string sa((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+  std::string sb((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+  if (sa != sb) Error("merging the work queue twice gave different results");
+
+  std::filesystem::remove_all(dir);
+  printf("%-24s %-28s %10zu workers %10zu tasks\n", "Work queue", "OK", nWorkers, nTasks);
+  return 0;
+} // function main
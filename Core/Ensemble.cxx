@@ -0,0 +1,320 @@
+#include "Core/Ensemble.h"
+#include "Core/Instrumentation.h"
+#include "Core/OscCalcPool.h"
+#include "Core/OscProbTable.h"
+#include "Core/PredictionTensor.h"
+
+#include "tbb/parallel_for.h"
+
+#include <memory>
+#include <mutex>
+#include <set>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// How the samples' bins are laid out and which are tensor-backed, fixed
+  /// until the ensemble is invalidated, plus the workspaces left idle by
+  /// earlier prediction calls
+  struct Ensemble::Layout {
+    std::vector<size_t> offsets; // one per sample, then NBins()
+    std::vector<char>   tensor;  // whether each sample is tensor-backed
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Workspace>> idle;
+  }; // struct Ensemble::Layout
+
+  /// Everything one prediction call writes to: a probability table with
+  /// every tensor-backed sample registered, the calculator pool, and
+  /// which samples use the table at the current shifts
+  struct Ensemble::Workspace {
+    OscProbTable probs;
+    std::unique_ptr<OscCalcPool> calcs;
+    std::vector<char> useTensor;
+  }; // struct Ensemble::Workspace
+
+  /// Borrows an idle workspace for the length of one call, only making a
+  /// new one when every existing workspace is in use by another call
+  class Ensemble::Lease {
+
+  public:
+
+    Lease(const Ensemble& ens, std::shared_ptr<Layout> layout, osc::IOscCalc* calc)
+      : fEnsemble(ens), fLayout(layout), fCalc(calc)
+    {
+      {
+        std::lock_guard<std::mutex> lock(fLayout->mutex);
+        if (!fLayout->idle.empty()) {
+          fWork = std::move(fLayout->idle.back());
+          fLayout->idle.pop_back();
+        }
+      }
+      if (fWork) fWork->calcs->SetMaster(calc);
+      else {
+        fWork.reset(new Workspace);
+        for (size_t i = 0; i < ens.size(); ++i)
+          if (fLayout->tensor[i]) ens.Tensor(i)->Register(fWork->probs);
+        fWork->calcs.reset(new OscCalcPool(calc));
+        fWork->useTensor.resize(ens.size());
+      }
+    } // Lease constructor
+
+    ~Lease()
+    {
+      std::lock_guard<std::mutex> lock(fLayout->mutex);
+      fLayout->idle.push_back(std::move(fWork));
+    } // Lease destructor
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    Workspace* operator->() { return fWork.get(); };
+
+    /// Pick the samples to predict from the probability table at these
+    /// shifts, and fill it if any are
+    void Prepare(const SystShifts& shifts)
+    {
+      bool any = false;
+      for (size_t i = 0; i < fEnsemble.size(); ++i) {
+        fWork->useTensor[i] = fEnsemble.UseTensor(*fLayout, i, shifts);
+        if (fWork->useTensor[i]) any = true;
+      }
+      if (any) fWork->probs.Fill(fCalc);
+    } // function Lease::Prepare
+
+  protected:
+
+    const Ensemble& fEnsemble;
+    std::shared_ptr<Layout> fLayout;
+    osc::IOscCalc* fCalc;
+    std::unique_ptr<Workspace> fWork;
+
+  }; // class Ensemble::Lease
+
+  //---------------------------------------------------------------------------
+  Ensemble::Ensemble(const std::vector<Sample>& samples)
+    : fSamples(samples)
+  {
+    std::set<unsigned int> ids;
+    for (const Sample& s : fSamples)
+      if (!ids.insert(s.GetID()).second)
+        Error("sample "+s.Name()+" appears more than once in ensemble");
+  } // Ensemble constructor
+
+  //---------------------------------------------------------------------------
+  Ensemble::Ensemble(const std::string& id)
+    : Ensemble(Sample::FromEnsembleID(id))
+  {} // Ensemble constructor
+
+  //---------------------------------------------------------------------------
+  Ensemble::Ensemble(const Ensemble& other)
+    : fSamples(other.fSamples)
+  {} // Ensemble copy constructor
+
+  //---------------------------------------------------------------------------
+  Ensemble& Ensemble::operator=(const Ensemble& other)
+  {
+    fSamples = other.fSamples;
+    Invalidate();
+    return *this;
+  } // Ensemble assignment operator
+
+  //---------------------------------------------------------------------------
+  size_t Ensemble::Index(const Sample& s) const
+  {
+    for (size_t i = 0; i < fSamples.size(); ++i)
+      if (fSamples[i] == s) return i;
+    Error("sample "+s.Name()+" not found in ensemble "+ID());
+    return fSamples.size();
+  } // function Ensemble::Index
+
+  //---------------------------------------------------------------------------
+  size_t Ensemble::NBins() const
+  {
+    return GetLayout()->offsets.back();
+  } // function Ensemble::NBins
+
+  //---------------------------------------------------------------------------
+  size_t Ensemble::Offset(size_t i) const
+  {
+    if (i > fSamples.size()) Error("sample index out of range in ensemble "+ID());
+    return GetLayout()->offsets[i];
+  } // function Ensemble::Offset
+
+  //---------------------------------------------------------------------------
+  void Ensemble::Invalidate()
+  {
+    std::lock_guard<std::mutex> lock(fLayoutMutex);
+    fLayout.reset();
+  } // function Ensemble::Invalidate
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<Ensemble::Layout> Ensemble::GetLayout() const
+  {
+    std::lock_guard<std::mutex> lock(fLayoutMutex);
+    if (fLayout) return fLayout;
+
+    fLayout = std::make_shared<Layout>();
+    fLayout->offsets.push_back(0);
+    for (size_t i = 0; i < fSamples.size(); ++i) {
+      fLayout->offsets.push_back(fLayout->offsets.back() + fSamples[i].GetBinning().NBins());
+      // Only the type is kept, so lazy tensors can still be evicted
+      fLayout->tensor.push_back(bool(Tensor(i)));
+    }
+    return fLayout;
+  } // function Ensemble::GetLayout
+
+  //---------------------------------------------------------------------------
+  bool Ensemble::UseTensor(const Layout& layout, size_t i, const SystShifts& shifts) const
+  {
+    return layout.tensor[i] && (shifts.IsNominal() || fSamples[i].IsNominal(shifts));
+  } // function Ensemble::UseTensor
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<PredictionTensor> Ensemble::Tensor(size_t i) const
+  {
+    if (!fSamples[i].HasPrediction()) return nullptr;
+    return std::dynamic_pointer_cast<PredictionTensor>(fSamples[i].Prediction());
+  } // function Ensemble::Tensor
+
+  //---------------------------------------------------------------------------
+  std::vector<Spectrum> Ensemble::Predict(osc::IOscCalc* calc,
+                                          const SystShifts& shifts) const
+  {
+    std::vector<Spectrum> ret(fSamples.size(), Spectrum::Uninitialized());
+
+    // Oscillation calculators cache internal state, so each thread gets its
+    // own from the pool, and tensor-backed samples share one probability
+    // table
+    Lease work(*this, GetLayout(), calc);
+    work.Prepare(shifts);
+
+    tbb::parallel_for(size_t(0), fSamples.size(), [&](size_t i) {
+      if (work->useTensor[i]) ret[i] = Tensor(i)->Predict(work->probs);
+      else ret[i] = fSamples[i].Predict(work->calcs->Local(), shifts);
+    });
+    return ret;
+  } // function Ensemble::Predict
+
+  //---------------------------------------------------------------------------
+  void Ensemble::PredictInto(Eigen::Ref<Eigen::ArrayXd> out,
+                             osc::IOscCalc* calc,
+                             const SystShifts& shifts) const
+  {
+    std::shared_ptr<Layout> layout = GetLayout();
+    const std::vector<size_t>& offsets = layout->offsets;
+    if (size_t(out.size()) != offsets.back())
+      Error("output has the wrong number of bins for ensemble "+ID());
+
+    Lease work(*this, layout, calc);
+    work.Prepare(shifts);
+
+    tbb::parallel_for(size_t(0), fSamples.size(), [&](size_t i) {
+      PISCES_TIME("Ensemble::PredictInto", fSamples[i].GetID());
+      Eigen::Ref<Eigen::ArrayXd> seg = out.segment(offsets[i], offsets[i+1]-offsets[i]);
+      if (work->useTensor[i]) {
+        std::shared_ptr<PredictionTensor> tensor = Tensor(i);
+        thread_local Eigen::MatrixXd w;
+        tensor->OscWeights(work->probs, w);
+        tensor->PredictInto(seg, w, fSamples[i].POT());
+      }
+      else fSamples[i].PredictInto(seg, work->calcs->Local(), shifts);
+    });
+  } // function Ensemble::PredictInto
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd Ensemble::PredictShifts(osc::IOscCalc* calc,
+                                          const std::vector<SystShifts>& points) const
+  {
+    std::shared_ptr<Layout> layout = GetLayout();
+    const std::vector<size_t>& offsets = layout->offsets;
+
+    // Work in bins x points so each sample's segment of a point is contiguous
+    Eigen::ArrayXd nominal(offsets.back());
+    PredictInto(nominal, calc, kNoShift);
+    Eigen::ArrayXXd ret(offsets.back(), points.size());
+
+    std::vector<std::pair<size_t, size_t>> jobs;
+    for (size_t p = 0; p < points.size(); ++p) {
+      for (size_t i = 0; i < fSamples.size(); ++i) {
+        size_t n = offsets[i+1] - offsets[i];
+        if (fSamples[i].IsNominal(points[p]))
+          ret.col(p).segment(offsets[i], n) = nominal.segment(offsets[i], n);
+        else jobs.emplace_back(p, i);
+      } // for sample
+    } // for point
+
+    Lease work(*this, layout, calc);
+
+    tbb::parallel_for(size_t(0), jobs.size(), [&](size_t j) {
+      const auto& [p, i] = jobs[j];
+      Eigen::Ref<Eigen::ArrayXd> seg = ret.col(p).segment(offsets[i], offsets[i+1]-offsets[i]);
+      fSamples[i].PredictInto(seg, work->calcs->Local(), points[p]);
+    });
+    return ret.transpose();
+  } // function Ensemble::PredictShifts
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd Ensemble::Jacobian(osc::IOscCalc* calc,
+                                     const std::vector<const ISyst*>& systs,
+                                     double step,
+                                     const SystShifts& base) const
+  {
+    if (step <= 0) Error("finite-difference step must be positive in ensemble "+ID());
+
+    // Without forcing, SetShift clamps to the syst's range, and the
+    // difference would be divided by a step that wasn't taken
+    std::vector<SystShifts> points;
+    for (const ISyst* syst : systs) {
+      for (double sign : { 1., -1. }) {
+        SystShifts shift = base;
+        shift.SetShift(syst, base.GetShift(syst) + sign*step, true);
+        points.push_back(shift);
+      }
+    }
+
+    Eigen::ArrayXXd preds = PredictShifts(calc, points);
+    Eigen::MatrixXd ret(preds.cols(), systs.size());
+    for (size_t i = 0; i < systs.size(); ++i)
+      ret.col(i) = ((preds.row(2*i) - preds.row(2*i+1)) / (2*step)).transpose().matrix();
+    return ret;
+  } // function Ensemble::Jacobian
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXstan Ensemble::PredictStan(osc::IOscCalcStan* calc,
+                                          const SystShifts& shifts) const
+  {
+    Eigen::ArrayXstan ret(NBins());
+    size_t offset = 0;
+    for (const Sample& s : fSamples) {
+      size_t n = s.GetBinning().NBins();
+      ret.segment(offset, n) = s.PredictStan(calc, shifts);
+      offset += n;
+    }
+    return ret;
+  } // function Ensemble::PredictStan
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd Ensemble::Cosmics() const
+  {
+    Eigen::ArrayXd ret = Eigen::ArrayXd::Zero(NBins());
+    size_t offset = 0;
+    for (const Sample& s : fSamples) {
+      size_t n = s.GetBinning().NBins();
+      if (s.HasCosmic())
+        ret.segment(offset, n) = s.Cosmic().GetEigen(s.Livetime(), kLivetime).segment(1, n);
+      offset += n;
+    }
+    return ret;
+  } // function Ensemble::Cosmics
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd Ensemble::Expected(osc::IOscCalc* calc,
+                                    const SystShifts& shifts) const
+  {
+    Eigen::ArrayXd ret(NBins());
+    PredictInto(ret, calc, shifts);
+    return ret + Cosmics();
+  } // function Ensemble::Expected
+
+} // namespace pisces
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "Core/Sample.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace pisces {
+
+  class PredictionTensor;
+
+  using namespace ana;
+
+  /// Container owning an ordered set of Samples, which are predicted together
+  class Ensemble {
+
+  public:
+
+    // Constructors
+    Ensemble(const std::vector<Sample>& samples);
+    Ensemble(const std::string& id);
+    /// Copies share nothing but the samples themselves
+    Ensemble(const Ensemble& other);
+    Ensemble& operator=(const Ensemble& other);
+
+    /// Get ensemble ID string, as produced by Sample::EnsembleID
+    std::string ID() const { return Sample::EnsembleID(fSamples); };
+
+    size_t size()  const { return fSamples.size();  };
+    bool   empty() const { return fSamples.empty(); };
+
+    /// Non-const access to the samples drops the bin layout and tensor
+    /// list worked out for predicting, which are rebuilt on next use. A
+    /// reference kept from before a prediction and changed after it isn't
+    /// noticed, so call Invalidate() after doing that
+    Sample&       operator[](size_t i)       { Invalidate(); return fSamples[i]; };
+    const Sample& operator[](size_t i) const { return fSamples[i]; };
+
+    std::vector<Sample>::iterator       begin()       { Invalidate(); return fSamples.begin(); };
+    std::vector<Sample>::iterator       end()         { Invalidate(); return fSamples.end();   };
+    std::vector<Sample>::const_iterator begin() const { return fSamples.begin(); };
+    std::vector<Sample>::const_iterator end()   const { return fSamples.end();   };
+
+    const std::vector<Sample>& Samples() const { return fSamples; };
+
+    /// Index of sample in the ensemble, or Error if it isn't present
+    size_t Index(const Sample& s) const;
+
+    /// Total number of analysis bins across all samples
+    size_t NBins() const;
+    /// Position of a sample's first bin when all samples' bins are
+    /// concatenated in ensemble order
+    size_t Offset(size_t i) const;
+
+    /// Forget the bin layout and tensor list, after changing a sample
+    /// through a reference held since before the last prediction
+    void Invalidate();
+
+    /// Predict every sample concurrently. Results are returned in the same
+    /// order as the samples, regardless of how the work was scheduled. Each
+    /// thread evaluates on its own copy of the calculator, from a pool kept
+    /// between calls. Samples with tensor predictions share a single table
+    /// of oscillation probabilities. The prediction methods may be called
+    /// from several threads at once, each call taking its own workspace
+    std::vector<Spectrum> Predict(osc::IOscCalc* calc,
+                                  const SystShifts& shifts=kNoShift) const;
+
+    /// Write every sample's predicted bin contents, at its own POT, into
+    /// the matching segment of out, which must hold NBins() bins
+    void PredictInto(Eigen::Ref<Eigen::ArrayXd> out,
+                     osc::IOscCalc* calc,
+                     const SystShifts& shifts=kNoShift) const;
+
+    /// Predict the whole ensemble at many shift points in one call,
+    /// returning a points x NBins() array. The nominal prediction is made
+    /// once and reused wherever a point doesn't move a sample (for example
+    /// when its systs are aliased away), and the rest of the (point, sample)
+    /// pairs are evaluated in parallel
+    Eigen::ArrayXXd PredictShifts(osc::IOscCalc* calc,
+                                  const std::vector<SystShifts>& points) const;
+
+    /// Central finite-difference derivative of every bin with respect to
+    /// each syst, evaluated at +/- step sigma about base. Shifts are forced
+    /// past each syst's range, so the step taken is always the one asked
+    /// for. Returns NBins() x systs
+    Eigen::MatrixXd Jacobian(osc::IOscCalc* calc,
+                             const std::vector<const ISyst*>& systs,
+                             double step=1,
+                             const SystShifts& base=kNoShift) const;
+
+    /// Concatenated autodiff bin contents, as Sample::PredictStan. Runs on
+    /// the calling thread, since that's where the autodiff tape lives
+    Eigen::ArrayXstan PredictStan(osc::IOscCalcStan* calc,
+                                  const SystShifts& shifts=kNoShift) const;
+
+    /// Sample i's prediction if it's tensor-backed, or nullptr
+    std::shared_ptr<PredictionTensor> Tensor(size_t i) const;
+
+    /// Concatenated cosmic bin contents at each sample's livetime, with
+    /// zeros for samples without cosmics
+    Eigen::ArrayXd Cosmics() const;
+    /// Concatenated expected bin contents, predictions plus cosmics
+    Eigen::ArrayXd Expected(osc::IOscCalc* calc,
+                            const SystShifts& shifts=kNoShift) const;
+
+  protected:
+
+    struct Layout;
+    struct Workspace;
+    class  Lease;
+
+    /// Bin offsets and tensor-backed samples, built on first use after
+    /// construction or invalidation
+    std::shared_ptr<Layout> GetLayout() const;
+
+    /// Whether sample i should be predicted from the shared table at these
+    /// shifts, ie it's tensor-backed and they're nominal for it
+    bool UseTensor(const Layout& layout, size_t i, const SystShifts& shifts) const;
+    std::vector<Sample> fSamples;
+
+    mutable std::shared_ptr<Layout> fLayout;
+    mutable std::mutex fLayoutMutex;
+
+  }; // class Ensemble
+
+} // namespace pisces
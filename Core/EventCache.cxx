@@ -0,0 +1,359 @@
+#include "Core/EventCache.h"
+
+#include "CAFAna/Core/ISyst.h"
+#include "CAFAna/Core/SpectrumLoader.h"
+
+#include "duneanaobj/StandardRecord/Proxy/SRProxy.h"
+
+#include "tbb/blocked_range.h"
+#include "tbb/combinable.h"
+#include "tbb/parallel_for.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+namespace pisces {
+
+  using namespace ana;
+  using namespace eventcache;
+
+  //---------------------------------------------------------------------------
+  EventCacheBuilder::EventCacheBuilder(const Sample& s, const Var& trueEnergy,
+                                       const Cut& presel, const Var& weight)
+    : fSample(s), fPresel(presel)
+  {
+    fColumns.push_back({ kTrueEnergy, "", trueEnergy, nullptr, 0, {} });
+    fColumns.push_back({ kWeight,     "", weight,     nullptr, 0, {} });
+  } // EventCacheBuilder constructor
+
+  //---------------------------------------------------------------------------
+  void EventCacheBuilder::AddVar(const std::string& name, const Var& var)
+  {
+    if (NEvents()) Error("variables must be added to the event cache before filling it");
+    for (const Column& c : fColumns)
+      if (c.role == kReco && c.name == name)
+        Error("variable "+name+" already added to event cache for sample "+fSample.Name());
+    fColumns.push_back({ kReco, name, var, nullptr, 0, {} });
+  } // function EventCacheBuilder::AddVar
+
+  //---------------------------------------------------------------------------
+  void EventCacheBuilder::AddSyst(const ISyst* syst, const std::vector<double>& sigmas)
+  {
+    if (NEvents()) Error("systs must be added to the event cache before filling it");
+    for (double sigma : sigmas) {
+      if (sigma == 0) Error("syst knobs in the event cache must be non-zero");
+      fColumns.push_back({ kSyst, syst->ShortName(), kUnweighted, syst, sigma, {} });
+    }
+  } // function EventCacheBuilder::AddSyst
+
+  //---------------------------------------------------------------------------
+  void EventCacheBuilder::Fill(caf::SRProxy* sr)
+  {
+    if (!fPresel(sr)) return;
+
+    uint8_t chan = kNoChannel;
+    const std::vector<OscChannel>& channels = fSample.AllChannels();
+    for (size_t c = 0; c < channels.size(); ++c) {
+      if (channels[c].TruthCut()(sr)) {
+        chan = c;
+        break;
+      }
+    }
+    fChannel.push_back(chan);
+
+    for (Column& c : fColumns)
+      if (c.role != kSyst) c.data.push_back(c.var(sr));
+    // Systs may change the record as well as the weight, so roll back after
+    // each one. Otherwise a shift would leak into the next syst's response
+    // and into whatever the caller does with the record afterwards
+    for (Column& c : fColumns) {
+      if (c.role != kSyst) continue;
+      double w = 1;
+      caf::SRProxySystController::BeginTransaction();
+      c.syst->Shift(c.knob, sr, w);
+      caf::SRProxySystController::Rollback();
+      c.data.push_back(w);
+    }
+  } // function EventCacheBuilder::Fill
+
+  //---------------------------------------------------------------------------
+  void EventCacheBuilder::Write(const std::string& fname) const
+  {
+    if (fPOT <= 0) Error("POT must be set before writing event cache for sample "+fSample.Name());
+
+    std::vector<ColumnRecord> records;
+    std::string blob;
+    size_t offset = sizeof(FileHeader) + (fColumns.size()+1)*sizeof(ColumnRecord);
+    for (const Column& c : fColumns) {
+      records.push_back({ c.role, kFloat32, c.knob, 0, offset + blob.size(), c.name.size() });
+      blob += c.name;
+    }
+    records.push_back({ kChannel, kUInt8, 0, 0, offset + blob.size(), 0 });
+
+    // Lay out the column data after the blob, each aligned
+    offset += blob.size();
+    for (ColumnRecord& rec : records) {
+      offset = (offset + kAlignment - 1) / kAlignment * kAlignment;
+      rec.offset = offset;
+      offset += NEvents() * (rec.type == kUInt8 ? sizeof(uint8_t) : sizeof(float));
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.sampleID = fSample.GetID();
+    header.nEvents = NEvents();
+    header.nColumns = records.size();
+    header.pot = fPOT;
+    header.fileSize = offset;
+
+    std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+    if (!out) Error("failed to open event cache file "+fname+" for writing");
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)records.data(), records.size()*sizeof(ColumnRecord));
+    out.write(blob.data(), blob.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+      while (size_t(out.tellp()) < records[i].offset) out.put('\0');
+      if (i < fColumns.size())
+        out.write((const char*)fColumns[i].data.data(), NEvents()*sizeof(float));
+      else out.write((const char*)fChannel.data(), NEvents()*sizeof(uint8_t));
+    }
+    if (!out) Error("failed to write event cache file "+fname);
+  } // function EventCacheBuilder::Write
+
+  //---------------------------------------------------------------------------
+  EventCache::EventCache(const std::string& fname)
+    : fFile(std::make_shared<MappedFile>(fname))
+  {
+    const char* data = fFile->Data();
+    size_t size = fFile->Size();
+    if (size < sizeof(FileHeader)) Error("file "+fname+" is too small to be an event cache");
+    fHeader = (const FileHeader*)data;
+    if (std::memcmp(fHeader->magic, kMagic, sizeof(kMagic)))
+      Error("file "+fname+" is not an event cache");
+    if (fHeader->version != kVersion)
+      Error("event cache "+fname+" has version "+std::to_string(fHeader->version)
+            +", expected "+std::to_string(kVersion));
+    if (fHeader->fileSize != size) Error("event cache "+fname+" is truncated");
+
+    if (sizeof(FileHeader) + fHeader->nColumns*sizeof(ColumnRecord) > size)
+      Error("event cache "+fname+" is corrupt");
+    fColumns = (const ColumnRecord*)(data + sizeof(FileHeader));
+
+    for (uint64_t i = 0; i < fHeader->nColumns; ++i) {
+      const ColumnRecord& c = fColumns[i];
+      size_t width = c.type == kUInt8 ? sizeof(uint8_t) : sizeof(float);
+      if (c.type > kUInt8 || c.offset % kAlignment
+          || c.offset + fHeader->nEvents*width > size)
+        Error("event cache "+fname+" has a corrupt column");
+    }
+    if (!FindColumn(kTrueEnergy) || !FindColumn(kWeight) || !FindColumn(kChannel))
+      Error("event cache "+fname+" is missing a required column");
+  } // EventCache constructor
+
+  //---------------------------------------------------------------------------
+  bool EventCache::HasColumn(const std::string& name) const
+  {
+    return FindColumn(kReco, name) != nullptr;
+  } // function EventCache::HasColumn
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::ArrayXf> EventCache::Column(const std::string& name) const
+  {
+    const ColumnRecord* col = FindColumn(kReco, name);
+    if (!col) Error("variable "+name+" not found in event cache "+fFile->Name());
+    return Floats(col);
+  } // function EventCache::Column
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::ArrayXf> EventCache::TrueEnergy() const
+  {
+    return Floats(FindColumn(kTrueEnergy));
+  } // function EventCache::TrueEnergy
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::ArrayXf> EventCache::Weight() const
+  {
+    return Floats(FindColumn(kWeight));
+  } // function EventCache::Weight
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::Array<uint8_t, Eigen::Dynamic, 1>> EventCache::Channel() const
+  {
+    return Eigen::Map<const Eigen::Array<uint8_t, Eigen::Dynamic, 1>>(
+      (const uint8_t*)(fFile->Data() + FindColumn(kChannel)->offset), NEvents());
+  } // function EventCache::Channel
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd EventCache::Weights(const SystShifts& shifts) const
+  {
+    Eigen::ArrayXd ret = Weight().cast<double>();
+    for (const ISyst* syst : shifts.ActiveSysts()) {
+      // Knobs for this syst, with the implicit response of 1 at zero
+      std::map<double, const ColumnRecord*> knots { { 0., nullptr } };
+      for (uint64_t i = 0; i < fHeader->nColumns; ++i)
+        if (fColumns[i].role == kSyst && String(fColumns[i].nameOffset, fColumns[i].nameSize) == syst->ShortName())
+          knots[fColumns[i].knob] = &fColumns[i];
+      if (knots.size() < 2) continue;
+
+      // The shift is the same for every event, so pick the segment once
+      double sigma = shifts.GetShift(syst);
+      auto hi = knots.upper_bound(sigma);
+      if (hi == knots.begin()) ++hi;
+      if (hi == knots.end()) --hi;
+      auto lo = std::prev(hi);
+      auto resp = [this](const ColumnRecord* col) -> Eigen::ArrayXd {
+        if (!col) return Eigen::ArrayXd::Ones(NEvents());
+        return Floats(col).cast<double>();
+      };
+      double frac = (sigma - lo->first) / (hi->first - lo->first);
+      ret *= ((1-frac) * resp(lo->second) + frac * resp(hi->second)).max(0.);
+    } // for syst
+    return ret;
+  } // function EventCache::Weights
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd EventCache::Fill(const Eigen::Ref<const Eigen::ArrayXd>& var,
+                                   const Binning& bins, const ArrayXb& pass,
+                                   double pot, const SystShifts& shifts) const
+  {
+    CheckSize(var.size(), "variable");
+    if (pass.size()) CheckSize(pass.size(), "cut");
+
+    Eigen::ArrayXi rows = Channel().cast<int>();
+    rows = (rows == int(kNoChannel)).select(-1, rows);
+    if (pass.size()) rows = pass.select(rows, -1);
+    Eigen::ArrayXi cols = BinIndices(var, bins.Edges());
+    size_t nChannels = Sample(SampleID()).AllChannels().size();
+    return Histogram(rows, cols, Weights(shifts) * (pot / POT()), nChannels, bins.NBins());
+  } // function EventCache::Fill
+
+  //---------------------------------------------------------------------------
+  std::unique_ptr<PredictionTensor> EventCache::MakeTensor(const Sample& s,
+                                                           const Eigen::Ref<const Eigen::ArrayXd>& reco,
+                                                           const ArrayXb& pass,
+                                                           const Binning& trueBins) const
+  {
+    if (s.GetID() != SampleID())
+      Error("event cache "+fFile->Name()+" doesn't belong to sample "+s.Name());
+    CheckSize(reco.size(), "variable");
+    if (pass.size()) CheckSize(pass.size(), "cut");
+
+    // Rows are reco bins, and columns true bins with channels side by side
+    size_t nReco = s.GetBinning().NBins(), nTrue = trueBins.NBins();
+    size_t nChannels = s.AllChannels().size();
+    Eigen::ArrayXi rows = BinIndices(reco, s.GetBinning().Edges());
+    if (pass.size()) rows = pass.select(rows, -1);
+    Eigen::ArrayXi trueBin = BinIndices(TrueEnergy().cast<double>(), trueBins.Edges());
+    Eigen::ArrayXi chan = Channel().cast<int>();
+    Eigen::ArrayXi cols = (trueBin < 0 || chan == int(kNoChannel)).select(-1, chan*int(nTrue) + trueBin);
+
+    Eigen::ArrayXXd h = Histogram(rows, cols, Weights(), nReco, nChannels*nTrue);
+    std::vector<Eigen::MatrixXd> responses;
+    for (size_t c = 0; c < nChannels; ++c)
+      responses.push_back(h.middleCols(c*nTrue, nTrue).matrix());
+    return std::make_unique<PredictionTensor>(s, trueBins, responses, POT());
+  } // function EventCache::MakeTensor
+
+  //---------------------------------------------------------------------------
+  PrecisionReport EventCache::Compare(const Sample& s, const std::string& wildcard,
+                                      const Eigen::Ref<const Eigen::ArrayXd>& reco,
+                                      const ArrayXb& pass, const Binning& trueBins,
+                                      const Var& weight) const
+  {
+    // The reference is the same selection run through CAFAna, with one
+    // spectrum per channel
+    SpectrumLoader loader(wildcard);
+    const std::vector<OscChannel>& channels = s.AllChannels();
+    std::vector<std::unique_ptr<Spectrum>> specs;
+    for (const OscChannel& ch : channels)
+      specs.push_back(std::make_unique<Spectrum>(loader, s.GetAxis(), s.GetCut() && ch.TruthCut(),
+                                                 kNoShift, weight));
+    loader.Go();
+
+    size_t nReco = s.GetBinning().NBins();
+    Eigen::ArrayXXd ref(channels.size(), nReco);
+    for (size_t c = 0; c < channels.size(); ++c)
+      ref.row(c) = specs[c]->GetEigen(POT()).segment(1, nReco).transpose();
+
+    // Summing the tensor over true energy should give the histogram back
+    std::unique_ptr<PredictionTensor> tensor = MakeTensor(s, reco, pass, trueBins);
+    Eigen::ArrayXXd fromTensor(channels.size(), nReco);
+    for (size_t c = 0; c < channels.size(); ++c)
+      fromTensor.row(c) = tensor->ResponseView(c).rowwise().sum().transpose().array();
+
+    PrecisionReport ret { 0, 0 };
+    for (const Eigen::ArrayXXd& test : { Fill(reco, s.GetBinning(), pass, POT()), fromTensor }) {
+      Eigen::ArrayXXd diff = (test - ref).abs();
+      ret.maxAbs = std::max(ret.maxAbs, diff.maxCoeff());
+      ret.maxRel = std::max(ret.maxRel, (ref > 0).select(diff / ref, 0.).maxCoeff());
+    }
+    return ret;
+  } // function EventCache::Compare
+
+  //---------------------------------------------------------------------------
+  const ColumnRecord* EventCache::FindColumn(ColumnRole role, const std::string& name) const
+  {
+    for (uint64_t i = 0; i < fHeader->nColumns; ++i)
+      if (fColumns[i].role == role && String(fColumns[i].nameOffset, fColumns[i].nameSize) == name)
+        return &fColumns[i];
+    return nullptr;
+  } // function EventCache::FindColumn
+
+  //---------------------------------------------------------------------------
+  std::string EventCache::String(uint64_t offset, uint64_t size) const
+  {
+    if (offset + size > fFile->Size()) Error("event cache "+fFile->Name()+" is corrupt");
+    return std::string(fFile->Data() + offset, size);
+  } // function EventCache::String
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::ArrayXf> EventCache::Floats(const ColumnRecord* col) const
+  {
+    return Eigen::Map<const Eigen::ArrayXf>((const float*)(fFile->Data() + col->offset), NEvents());
+  } // function EventCache::Floats
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXi EventCache::BinIndices(const Eigen::Ref<const Eigen::ArrayXd>& x,
+                                        const std::vector<double>& edges)
+  {
+    Eigen::ArrayXi ret(x.size());
+    int nBins = edges.size() - 1;
+    tbb::parallel_for(tbb::blocked_range<Eigen::Index>(0, x.size()),
+                      [&](const tbb::blocked_range<Eigen::Index>& r) {
+      for (Eigen::Index i = r.begin(); i < r.end(); ++i) {
+        int bin = std::upper_bound(edges.begin(), edges.end(), x(i)) - edges.begin() - 1;
+        ret(i) = bin < 0 || bin >= nBins ? -1 : bin;
+      }
+    });
+    return ret;
+  } // function EventCache::BinIndices
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd EventCache::Histogram(const Eigen::ArrayXi& rows, const Eigen::ArrayXi& cols,
+                                        const Eigen::ArrayXd& w, size_t nRows, size_t nCols)
+  {
+    tbb::combinable<Eigen::ArrayXXd> local([nRows, nCols]() {
+      return Eigen::ArrayXXd::Zero(nRows, nCols).eval();
+    });
+    tbb::parallel_for(tbb::blocked_range<Eigen::Index>(0, w.size()),
+                      [&](const tbb::blocked_range<Eigen::Index>& r) {
+      Eigen::ArrayXXd& h = local.local();
+      for (Eigen::Index i = r.begin(); i < r.end(); ++i)
+        if (rows(i) >= 0 && cols(i) >= 0) h(rows(i), cols(i)) += w(i);
+    });
+    Eigen::ArrayXXd ret = Eigen::ArrayXXd::Zero(nRows, nCols);
+    local.combine_each([&ret](const Eigen::ArrayXXd& h) { ret += h; });
+    return ret;
+  } // function EventCache::Histogram
+
+  //---------------------------------------------------------------------------
+  void EventCache::CheckSize(Eigen::Index n, const std::string& what) const
+  {
+    if (size_t(n) != NEvents())
+      Error(what+" doesn't have one entry per event in event cache "+fFile->Name());
+  } // function EventCache::CheckSize
+
+} // namespace pisces
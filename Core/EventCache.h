@@ -0,0 +1,196 @@
+#pragma once
+
+#include "Core/MappedFile.h"
+#include "Core/PredictionTensor.h"
+#include "Core/Sample.h"
+
+#include "CAFAna/Core/Binning.h"
+#include "CAFAna/Core/Var.h"
+
+#include <Eigen/Dense>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  namespace eventcache {
+
+    const char kMagic[8] = { 'P', 'I', 'S', 'C', 'E', 'V', 'T', 'C' };
+    const uint32_t kVersion = 1;
+
+    /// Columns are stored contiguously, each aligned to this many bytes
+    const size_t kAlignment = 64;
+
+    enum DataType : uint32_t { kFloat32 = 0, kUInt8 = 1 };
+
+    enum ColumnRole : uint32_t {
+      kTrueEnergy = 0,
+      kWeight     = 1,
+      kChannel    = 2, // index into the sample's AllChannels()
+      kReco       = 3,
+      kSyst       = 4  // event weight ratio with the syst at knob sigma
+    };
+
+    /// Channel index of events passing none of the channels' truth cuts
+    const uint8_t kNoChannel = 255;
+
+    // On-disk layout: a FileHeader, nColumns ColumnRecords, a blob of
+    // names, then the aligned column data. All offsets are from the start
+    // of the file
+    struct FileHeader {
+      char     magic[8];
+      uint32_t version;
+      uint32_t sampleID;
+      uint64_t nEvents;
+      uint64_t nColumns;
+      double   pot;
+      uint64_t fileSize;
+    };
+
+    struct ColumnRecord {
+      uint32_t role;
+      uint32_t type;
+      double   knob;
+      uint64_t offset;
+      uint64_t nameOffset; // reco variable name, or syst short name
+      uint64_t nameSize;
+    };
+
+  } // namespace eventcache
+
+  typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
+
+  /// Collects per-event columns for one sample during a single pass over
+  /// the CAFs: true energy, weight, oscillation channel, any number of reco
+  /// variables and the weight response to each syst at a few knob values.
+  /// Call Fill once per event from the CAF loop, then Write the result for
+  /// EventCache to rebin and recut without going back to the CAFs
+  class EventCacheBuilder {
+
+  public:
+
+    /// Only events passing presel are kept, so it should be looser than
+    /// any cut to be studied
+    EventCacheBuilder(const Sample& s, const Var& trueEnergy,
+                      const Cut& presel=kNoCut, const Var& weight=kUnweighted);
+
+    void AddVar(const std::string& name, const Var& var);
+    /// Record syst's weight response at each knob value. Systs which move
+    /// reco variables rather than reweighting can't be cached this way, and
+    /// need a separate cache extracted with the shift applied
+    void AddSyst(const ISyst* syst, const std::vector<double>& sigmas);
+
+    /// Record one event, if it passes the preselection
+    void Fill(caf::SRProxy* sr);
+    /// Exposure the filled events correspond to
+    void SetPOT(double pot) { fPOT = pot; };
+
+    size_t NEvents() const { return fChannel.size(); };
+
+    void Write(const std::string& fname) const;
+
+  protected:
+
+    /// One float column, and how to fill it from an event: with var, or
+    /// for syst columns by shifting syst to knob
+    struct Column {
+      eventcache::ColumnRole role;
+      std::string            name;
+      Var                    var;
+      const ISyst*           syst;
+      double                 knob;
+      std::vector<float>     data;
+    };
+
+    Sample fSample;
+    Cut    fPresel;
+    double fPOT = 0;
+
+    std::vector<Column>  fColumns;
+    std::vector<uint8_t> fChannel;
+
+  }; // class EventCacheBuilder
+
+  /// Read-only, memory-mapped view of an event cache. Every event is one
+  /// entry in each column, so new axes and cuts are written as expressions
+  /// over whole columns (eg cache.Column("erec") > 0.5) and histogrammed
+  /// in parallel, in seconds rather than a CAF loop's hours
+  class EventCache {
+
+  public:
+
+    EventCache(const std::string& fname);
+
+    unsigned int SampleID() const { return fHeader->sampleID; };
+    size_t NEvents() const { return fHeader->nEvents; };
+    double POT() const { return fHeader->pot; };
+
+    bool HasColumn(const std::string& name) const;
+    /// Reco variable by the name it was added under
+    Eigen::Map<const Eigen::ArrayXf> Column(const std::string& name) const;
+    Eigen::Map<const Eigen::ArrayXf> TrueEnergy() const;
+    Eigen::Map<const Eigen::ArrayXf> Weight() const;
+    /// Index of each event's channel in the sample's AllChannels(), or
+    /// eventcache::kNoChannel
+    Eigen::Map<const Eigen::Array<uint8_t, Eigen::Dynamic, 1>> Channel() const;
+
+    /// Event weights at these shifts, interpolating linearly between each
+    /// syst's recorded knobs (and 1 at zero), and extrapolating from the
+    /// outermost pair. Systs the cache has no response for are ignored
+    Eigen::ArrayXd Weights(const SystShifts& shifts=kNoShift) const;
+
+    /// Histogram var into bins for events passing pass (which may be
+    /// empty to keep every event), at pot. Returns a channels x bins array
+    /// matching Sample::PredictAllChannels, without under or overflow
+    Eigen::ArrayXXd Fill(const Eigen::Ref<const Eigen::ArrayXd>& var,
+                         const Binning& bins, const ArrayXb& pass,
+                         double pot, const SystShifts& shifts=kNoShift) const;
+
+    /// Rebuild a tensor prediction for s, binned in its axis on reco and in
+    /// trueBins on true energy, from events passing pass
+    std::unique_ptr<PredictionTensor> MakeTensor(const Sample& s,
+                                                 const Eigen::Ref<const Eigen::ArrayXd>& reco,
+                                                 const ArrayXb& pass,
+                                                 const Binning& trueBins) const;
+
+    /// Check Fill and MakeTensor against s's axis and cut (with each
+    /// channel's truth cut) run through CAFAna over the CAF files in
+    /// wildcard. reco and pass should be the cache's versions of that axis
+    /// and cut, weight the one the cache was built with, and trueBins
+    /// should cover every event's true energy. Returns the largest
+    /// deviation in any channel and bin, at the cache's POT
+    PrecisionReport Compare(const Sample& s, const std::string& wildcard,
+                            const Eigen::Ref<const Eigen::ArrayXd>& reco,
+                            const ArrayXb& pass, const Binning& trueBins,
+                            const Var& weight=kUnweighted) const;
+
+  protected:
+
+    const eventcache::ColumnRecord* FindColumn(eventcache::ColumnRole role,
+                                               const std::string& name="") const;
+    std::string String(uint64_t offset, uint64_t size) const;
+    Eigen::Map<const Eigen::ArrayXf> Floats(const eventcache::ColumnRecord* col) const;
+
+    /// Index of each value's bin, or -1 if it falls outside them
+    static Eigen::ArrayXi BinIndices(const Eigen::Ref<const Eigen::ArrayXd>& x,
+                                     const std::vector<double>& edges);
+    /// Weighted nRows x nCols histogram, skipping events with either index
+    /// negative. Events are spread over threads, each with its own histogram
+    static Eigen::ArrayXXd Histogram(const Eigen::ArrayXi& rows, const Eigen::ArrayXi& cols,
+                                     const Eigen::ArrayXd& w, size_t nRows, size_t nCols);
+
+    void CheckSize(Eigen::Index n, const std::string& what) const;
+
+    std::shared_ptr<const MappedFile> fFile;
+
+    const eventcache::FileHeader*   fHeader;
+    const eventcache::ColumnRecord* fColumns;
+
+  }; // class EventCache
+
+} // namespace pisces
@@ -0,0 +1,84 @@
+#include "Core/Instrumentation.h"
+#include "Core/OscChannel.h"
+#include "Core/Sample.h"
+
+#include <fstream>
+#include <iomanip>
+
+namespace pisces {
+
+  //---------------------------------------------------------------------------
+  Instrumentation& Instrumentation::Instance()
+  {
+    static Instrumentation inst;
+    return inst;
+  } // function Instrumentation::Instance
+
+  //---------------------------------------------------------------------------
+  void Instrumentation::Record(std::string_view section, unsigned int sample,
+                               size_t channel, double seconds)
+  {
+    Stats& s = fStats.local()[{ section, sample, channel }];
+    ++s.calls;
+    s.total += seconds;
+    s.min = std::min(s.min, seconds);
+    s.max = std::max(s.max, seconds);
+  } // function Instrumentation::Record
+
+  //---------------------------------------------------------------------------
+  void Instrumentation::Reset()
+  {
+    for (std::map<Key, Stats>& local : fStats) local.clear();
+  } // function Instrumentation::Reset
+
+  //---------------------------------------------------------------------------
+  std::map<Instrumentation::Key, Instrumentation::Stats> Instrumentation::Merged() const
+  {
+    std::map<Key, Stats> ret;
+    for (const std::map<Key, Stats>& local : fStats) {
+      for (const auto& [key, s] : local) {
+        Stats& tot = ret[key];
+        tot.calls += s.calls;
+        tot.total += s.total;
+        tot.min = std::min(tot.min, s.min);
+        tot.max = std::max(tot.max, s.max);
+      }
+    } // for thread
+    return ret;
+  } // function Instrumentation::Merged
+
+  //---------------------------------------------------------------------------
+  void Instrumentation::WriteJSON(std::ostream& os) const
+  {
+    std::map<Key, Stats> merged = Merged();
+    os << std::setprecision(9)
+       << "{\n  \"enabled\": " << (Enabled() ? "true" : "false") << ",\n"
+       << "  \"entries\": [";
+    bool first = true;
+    for (const auto& [key, s] : merged) {
+      const auto& [section, id, channel] = key;
+      os << (first ? "\n" : ",\n")
+         << "    { \"section\": \"" << section << "\""
+         << ", \"sample\": " << id
+         << ", \"tag\": \"" << Sample(id).Tag() << "\""
+         << ", \"channel\": \""
+         << (channel == kNoChannel ? std::string_view() : oscchan::kChannels[channel].name) << "\""
+         << ", \"calls\": " << s.calls
+         << ", \"total_s\": " << s.total
+         << ", \"mean_s\": " << s.total / s.calls
+         << ", \"min_s\": " << s.min
+         << ", \"max_s\": " << s.max << " }";
+      first = false;
+    }
+    os << (first ? "" : "\n  ") << "]\n}\n";
+  } // function Instrumentation::WriteJSON
+
+  //---------------------------------------------------------------------------
+  void Instrumentation::WriteJSON(const std::string& fname) const
+  {
+    std::ofstream out(fname);
+    if (!out) Error("failed to open instrumentation output "+fname);
+    WriteJSON(out);
+  } // function Instrumentation::WriteJSON
+
+} // namespace pisces
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include <chrono>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+namespace pisces {
+
+  /// Call counters and timers for the prediction hot paths, aggregated per
+  /// sample ID and oscillation channel. Timing only happens when built with
+  /// PISCES_INSTRUMENTATION defined (the DUNEPISCES_INSTRUMENTATION cmake
+  /// option), otherwise PISCES_TIME compiles away and the dump is empty
+  class Instrumentation {
+
+  public:
+
+    /// Channel value for timings that aren't specific to one channel
+    static constexpr size_t kNoChannel = std::numeric_limits<size_t>::max();
+
+    static Instrumentation& Instance();
+
+    static constexpr bool Enabled()
+    {
+#ifdef PISCES_INSTRUMENTATION
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /// section must be a string literal, since only the view is stored
+    void Record(std::string_view section, unsigned int sample, size_t channel,
+                double seconds);
+
+    /// Forget everything recorded so far. Not safe to call while other
+    /// threads are recording
+    void Reset();
+
+    /// Write everything recorded, merged over threads, as JSON
+    void WriteJSON(std::ostream& os) const;
+    void WriteJSON(const std::string& fname) const;
+
+    struct Stats {
+      size_t calls = 0;
+      double total = 0;
+      double min = std::numeric_limits<double>::infinity();
+      double max = 0;
+    };
+    typedef std::tuple<std::string_view, unsigned int, size_t> Key;
+
+    /// Recorded statistics, merged over threads
+    std::map<Key, Stats> Merged() const;
+
+  protected:
+
+    Instrumentation() = default;
+
+    /// Each thread records into its own map, so recording never locks
+    mutable tbb::enumerable_thread_specific<std::map<Key, Stats>> fStats;
+
+  }; // class Instrumentation
+
+  /// Times its own lifetime and records it on destruction
+  class ScopedTimer {
+
+  public:
+
+    ScopedTimer(std::string_view section, unsigned int sample,
+                size_t channel=Instrumentation::kNoChannel)
+      : fSection(section), fSample(sample), fChannel(channel),
+        fStart(std::chrono::steady_clock::now())
+    {}
+
+    ~ScopedTimer()
+    {
+      std::chrono::duration<double> dt = std::chrono::steady_clock::now() - fStart;
+      Instrumentation::Instance().Record(fSection, fSample, fChannel, dt.count());
+    }
+
+  protected:
+
+    std::string_view fSection;
+    unsigned int fSample;
+    size_t fChannel;
+    std::chrono::steady_clock::time_point fStart;
+
+  }; // class ScopedTimer
+
+} // namespace pisces
+
+/// Time the rest of the enclosing scope. The arguments aren't evaluated at
+/// all unless instrumentation is compiled in
+#ifdef PISCES_INSTRUMENTATION
+#define PISCES_TIME_CAT2(a, b) a##b
+#define PISCES_TIME_CAT(a, b) PISCES_TIME_CAT2(a, b)
+#define PISCES_TIME(...) ::pisces::ScopedTimer PISCES_TIME_CAT(piscesTimer, __LINE__)(__VA_ARGS__)
+#else
+#define PISCES_TIME(...) ((void)0)
+#endif
@@ -0,0 +1,319 @@
+#include "Core/Likelihood.h"
+
+#include "stan/math/rev.hpp"
+
+#include <cmath>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string_view>
+
+namespace pisces {
+
+  using namespace ana;
+
+  // Floor on expected bin contents, to keep the logarithm finite
+  const double kMinExpected = 1e-40;
+
+  namespace {
+    // A covariance matrix and its Cholesky factor. The matrix is kept so a
+    // hash collision can't hand back the factor of a different one
+    struct CovFactor {
+      size_t hash;
+      Eigen::MatrixXd cov;
+      std::shared_ptr<Eigen::MatrixXd> l;
+    };
+
+    // Cholesky factors keyed by ensemble ID, several per ID if they were
+    // made for different matrices
+    std::multimap<std::string, CovFactor> gCovFactors;
+    std::mutex gCovMutex;
+
+    size_t HashMatrix(const Eigen::MatrixXd& m)
+    {
+      return std::hash<std::string_view>()(std::string_view((const char*)m.data(),
+                                                            m.size()*sizeof(double)));
+    } // function HashMatrix
+  } // anonymous namespace
+
+  //---------------------------------------------------------------------------
+  PoissonLikelihood::PoissonLikelihood(const Ensemble& ensemble)
+    : fEnsemble(ensemble)
+  {
+    for (size_t i = 0; i <= fEnsemble.size(); ++i)
+      fOffsets.push_back(fEnsemble.Offset(i));
+
+    size_t nBins = fOffsets.back();
+    fObs = Eigen::ArrayXd::Zero(nBins);
+    fExp = Eigen::ArrayXd::Zero(nBins);
+
+    // Cosmics are fixed for the lifetime of the likelihood, and so is the
+    // data unless it's replaced with SetObserved
+    fCosmic = fEnsemble.Cosmics();
+    fHasObs = true;
+    for (size_t i = 0; i < fEnsemble.size(); ++i) {
+      const Sample& s = fEnsemble[i];
+      if (s.HasData())
+        fObs.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]) = s.ToArray(s.Data());
+      else fHasObs = false;
+    } // for sample
+    fObsTerm = ObservedTerm(fObs);
+  } // PoissonLikelihood constructor
+
+  //---------------------------------------------------------------------------
+  void PoissonLikelihood::SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs)
+  {
+    if (obs.size() != fObs.size())
+      Error("observed bins don't match ensemble "+fEnsemble.ID());
+    fObs = obs;
+    fObsTerm = ObservedTerm(fObs);
+    fHasObs = true;
+  } // function PoissonLikelihood::SetObserved
+
+  //---------------------------------------------------------------------------
+  double PoissonLikelihood::Eval(osc::IOscCalc* calc, const SystShifts& shifts)
+  {
+    if (!fHasObs) Error("no observed data set for ensemble "+fEnsemble.ID());
+    fEnsemble.PredictInto(fExp, calc, shifts);
+    fExp += fCosmic;
+
+    // 2 * sum(e - o ln(e)) plus the precomputed observed-only terms
+    return 2 * (fExp.sum() - (fObs * fExp.max(kMinExpected).log()).sum() + fObsTerm);
+  } // function PoissonLikelihood::Eval
+
+  //---------------------------------------------------------------------------
+  stan::math::var PoissonLikelihood::EvalStan(osc::IOscCalcStan* calc,
+                                              const SystShifts& shifts)
+  {
+    if (!fHasObs) Error("no observed data set for ensemble "+fEnsemble.ID());
+    Eigen::ArrayXstan exp = fEnsemble.PredictStan(calc, shifts);
+
+    // Same sum as Eval, with the floor applied by hand so the tape only
+    // records one node per bin
+    stan::math::var ret = fObsTerm;
+    for (Eigen::Index i = 0; i < exp.size(); ++i) {
+      stan::math::var e = exp(i) + fCosmic(i);
+      fExp(i) = e.val();
+      ret += e;
+      if (fObs(i) > 0) ret -= fObs(i) * stan::math::log(e.val() > kMinExpected ? e : kMinExpected);
+    }
+    return 2 * ret;
+  } // function PoissonLikelihood::EvalStan
+
+  //---------------------------------------------------------------------------
+  double PoissonLikelihood::Gradient(osc::IOscCalcAdjustableStan* calc,
+                                     const std::vector<StanOscParam>& oscParams,
+                                     const std::vector<const ISyst*>& systs,
+                                     const SystShifts& shifts,
+                                     Eigen::VectorXd& grad)
+  {
+    std::vector<double> oscVals;
+    for (const StanOscParam& p : oscParams) oscVals.push_back(p.get(calc).val());
+
+    // Record on a nested tape, so everything it allocates is freed again.
+    // Calculators cache results keyed on parameter values, which would
+    // hand back probabilities without the new variables in them, so drop
+    // the cache once the variables are in place
+    stan::math::start_nested();
+    std::vector<stan::math::var> x;
+    for (size_t i = 0; i < oscParams.size(); ++i) {
+      x.emplace_back(oscVals[i]);
+      oscParams[i].set(calc, x.back());
+    }
+    calc->InvalidateCache();
+    SystShifts s = shifts;
+    for (const ISyst* syst : systs) {
+      x.emplace_back(shifts.GetShift(syst));
+      s.SetShift(syst, x.back(), true);
+    }
+
+    stan::math::var ret = EvalStan(calc, s);
+    stan::math::set_zero_all_adjoints_nested();
+    stan::math::grad(ret.vi_);
+    grad.resize(x.size());
+    for (size_t i = 0; i < x.size(); ++i) grad(i) = x[i].adj();
+    double val = ret.val();
+    stan::math::recover_memory_nested();
+
+    // The calculator mustn't keep variables, or results cached from them,
+    // from the freed tape
+    for (size_t i = 0; i < oscParams.size(); ++i) oscParams[i].set(calc, oscVals[i]);
+    calc->InvalidateCache();
+    return val;
+  } // function PoissonLikelihood::Gradient
+
+  //---------------------------------------------------------------------------
+  double PoissonLikelihood::LogLikelihood(const Eigen::Ref<const Eigen::ArrayXd>& exp,
+                                          const Eigen::Ref<const Eigen::ArrayXd>& obs)
+  {
+    return 2 * (exp.sum() - (obs * exp.max(kMinExpected).log()).sum() + ObservedTerm(obs));
+  } // function PoissonLikelihood::LogLikelihood
+
+  //---------------------------------------------------------------------------
+  double PoissonLikelihood::ObservedTerm(const Eigen::Ref<const Eigen::ArrayXd>& obs)
+  {
+    // Empty bins contribute nothing, so swap them for 1 to avoid 0 * ln(0)
+    return (obs * (obs > 0).select(obs, 1.).log() - obs).sum();
+  } // function PoissonLikelihood::ObservedTerm
+
+  //---------------------------------------------------------------------------
+  CovarianceChi2::CovarianceChi2(const Ensemble& ensemble, const Eigen::MatrixXd& cov)
+    : CovarianceChi2(ensemble, Factorise(ensemble, cov))
+  {} // CovarianceChi2 constructor
+
+  //---------------------------------------------------------------------------
+  CovarianceChi2::CovarianceChi2(const Ensemble& ensemble)
+    : CovarianceChi2(ensemble, Cached(ensemble))
+  {} // CovarianceChi2 constructor
+
+  //---------------------------------------------------------------------------
+  CovarianceChi2::CovarianceChi2(const Ensemble& ensemble,
+                                 std::shared_ptr<Eigen::MatrixXd> l)
+    : fEnsemble(ensemble), fL(l)
+  {
+    for (size_t i = 0; i <= fEnsemble.size(); ++i)
+      fOffsets.push_back(fEnsemble.Offset(i));
+
+    size_t nBins = fOffsets.back();
+    fObs = Eigen::ArrayXd::Zero(nBins);
+    fExp = Eigen::ArrayXd::Zero(nBins);
+    fResid = Eigen::VectorXd::Zero(nBins);
+
+    fCosmic = fEnsemble.Cosmics();
+    fHasObs = true;
+    for (size_t i = 0; i < fEnsemble.size(); ++i) {
+      const Sample& s = fEnsemble[i];
+      if (s.HasData())
+        fObs.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]) = s.ToArray(s.Data());
+      else fHasObs = false;
+    } // for sample
+  } // CovarianceChi2 constructor
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<Eigen::MatrixXd> CovarianceChi2::Factorise(const Ensemble& ensemble,
+                                                                   const Eigen::MatrixXd& cov)
+  {
+    size_t nBins = ensemble.NBins();
+    if (size_t(cov.rows()) != nBins || size_t(cov.cols()) != nBins)
+      Error("covariance matrix doesn't match the bins of ensemble "+ensemble.ID());
+
+    size_t hash = HashMatrix(cov);
+    {
+      std::lock_guard<std::mutex> lock(gCovMutex);
+      auto [begin, end] = gCovFactors.equal_range(ensemble.ID());
+      for (auto it = begin; it != end; ++it)
+        if (it->second.hash == hash && it->second.cov == cov) return it->second.l;
+    }
+
+    // Factorise outside the lock. Two threads racing on the same matrix
+    // both do the work, but the second then takes the first's factor
+    Eigen::LLT<Eigen::MatrixXd> llt(cov);
+    if (llt.info() != Eigen::Success)
+      Error("covariance matrix for ensemble "+ensemble.ID()+" isn't positive definite");
+    auto ret = std::make_shared<Eigen::MatrixXd>(llt.matrixL());
+
+    std::lock_guard<std::mutex> lock(gCovMutex);
+    auto [begin, end] = gCovFactors.equal_range(ensemble.ID());
+    for (auto it = begin; it != end; ++it)
+      if (it->second.hash == hash && it->second.cov == cov) return it->second.l;
+    gCovFactors.emplace(ensemble.ID(), CovFactor { hash, cov, ret });
+    return ret;
+  } // function CovarianceChi2::Factorise
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<Eigen::MatrixXd> CovarianceChi2::Cached(const Ensemble& ensemble)
+  {
+    std::lock_guard<std::mutex> lock(gCovMutex);
+    auto [begin, end] = gCovFactors.equal_range(ensemble.ID());
+    if (begin == end) Error("no covariance matrix cached for ensemble "+ensemble.ID());
+    if (std::next(begin) != end)
+      Error("several covariance matrices cached for ensemble "+ensemble.ID()+", pass the one to use");
+    // The ID alone doesn't pin down the binning, so an ensemble rebuilt
+    // with different axes under the same ID mustn't pick up the old factor
+    if (size_t(begin->second.l->rows()) != ensemble.NBins())
+      Error("cached covariance matrix doesn't match the bins of ensemble "+ensemble.ID());
+    return begin->second.l;
+  } // function CovarianceChi2::Cached
+
+  //---------------------------------------------------------------------------
+  void CovarianceChi2::ClearCache()
+  {
+    std::lock_guard<std::mutex> lock(gCovMutex);
+    gCovFactors.clear();
+  } // function CovarianceChi2::ClearCache
+
+  //---------------------------------------------------------------------------
+  void CovarianceChi2::SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs)
+  {
+    if (obs.size() != fObs.size())
+      Error("observed bins don't match ensemble "+fEnsemble.ID());
+    fObs = obs;
+    fHasObs = true;
+  } // function CovarianceChi2::SetObserved
+
+  //---------------------------------------------------------------------------
+  double CovarianceChi2::Eval(osc::IOscCalc* calc, const SystShifts& shifts)
+  {
+    if (!fHasObs) Error("no observed data set for ensemble "+fEnsemble.ID());
+    fEnsemble.PredictInto(fExp, calc, shifts);
+    fExp += fCosmic;
+    fResid.noalias() = (fObs - fExp).matrix();
+    return SolveResid();
+  } // function CovarianceChi2::Eval
+
+  //---------------------------------------------------------------------------
+  double CovarianceChi2::Chi2(const Eigen::Ref<const Eigen::ArrayXd>& resid)
+  {
+    if (resid.size() != fResid.size())
+      Error("residual doesn't match the bins of ensemble "+fEnsemble.ID());
+    fResid = resid.matrix();
+    return SolveResid();
+  } // function CovarianceChi2::Chi2
+
+  //---------------------------------------------------------------------------
+  double CovarianceChi2::SolveResid()
+  {
+    // r^T (L L^T)^-1 r = |L^-1 r|^2, so a single forward substitution
+    fL->triangularView<Eigen::Lower>().solveInPlace(fResid);
+    return fResid.squaredNorm();
+  } // function CovarianceChi2::SolveResid
+
+  //---------------------------------------------------------------------------
+  void CovarianceChi2::ScaleSample(size_t i, double scale)
+  {
+    if (i >= fEnsemble.size()) Error("no sample "+std::to_string(i)+" in ensemble "+fEnsemble.ID());
+    if (scale <= 0) Error("covariance scale must be positive");
+    // D V D = (D L)(D L)^T, and D L is still lower triangular with a
+    // positive diagonal, so it's the new factor
+    MutableL().middleRows(fOffsets[i], fOffsets[i+1]-fOffsets[i]) *= scale;
+  } // function CovarianceChi2::ScaleSample
+
+  //---------------------------------------------------------------------------
+  void CovarianceChi2::RankUpdate(const Eigen::MatrixXd& u, double sigma)
+  {
+    if (size_t(u.rows()) != fOffsets.back())
+      Error("rank update doesn't match the bins of ensemble "+fEnsemble.ID());
+    Eigen::MatrixXd& l = MutableL();
+    // The factor is kept bare rather than in an Eigen::LLT so ScaleSample
+    // can scale its rows, so call the in-place update LLT::rankUpdate()
+    // itself uses. It returns the failing column, or -1 on success
+    for (Eigen::Index k = 0; k < u.cols(); ++k)
+      if (Eigen::internal::llt_inplace<double, Eigen::Lower>::rankUpdate(l, u.col(k), sigma) >= 0)
+        Error("covariance for ensemble "+fEnsemble.ID()+" is no longer positive definite");
+  } // function CovarianceChi2::RankUpdate
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd CovarianceChi2::Covariance() const
+  {
+    return fL->triangularView<Eigen::Lower>() * fL->transpose();
+  } // function CovarianceChi2::Covariance
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd& CovarianceChi2::MutableL()
+  {
+    // The cache holds a reference too, so cached factors are never changed
+    if (fL.use_count() > 1) fL = std::make_shared<Eigen::MatrixXd>(*fL);
+    return *fL;
+  } // function CovarianceChi2::MutableL
+
+} // namespace pisces
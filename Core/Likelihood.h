@@ -0,0 +1,165 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+
+#include <Eigen/Dense>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// One oscillation parameter of a Stan calculator for autodiff gradients,
+  /// eg { [](const auto* c) { return c->GetdCP(); },
+  ///      [](auto* c, const stan::math::var& v) { c->SetdCP(v); } }
+  struct StanOscParam {
+    std::function<stan::math::var(const osc::IOscCalcAdjustableStan*)> get;
+    std::function<void(osc::IOscCalcAdjustableStan*, const stan::math::var&)> set;
+  }; // struct StanOscParam
+
+  /// Joint Poisson likelihood over every sample in an Ensemble. Observed
+  /// and expected bin contents of all samples are held in single contiguous
+  /// arrays, so evaluation is one vectorised pass with no allocation in the
+  /// kernel. Holds a reference to the ensemble, which must outlive it.
+  /// Evaluation writes to internal buffers, so each thread needs its own
+  /// instance
+  class PoissonLikelihood {
+
+  public:
+
+    PoissonLikelihood(const Ensemble& ensemble);
+
+    /// -2 log likelihood ratio of the ensemble's data given the prediction
+    double Eval(osc::IOscCalc* calc, const SystShifts& shifts=kNoShift);
+
+    /// -2 log likelihood ratio as an autodiff variable, with derivatives
+    /// with respect to the calculator's parameters and any shifts set as
+    /// stan::math::var
+    stan::math::var EvalStan(osc::IOscCalcStan* calc, const SystShifts& shifts=kNoShift);
+
+    /// -2 log likelihood ratio and its exact gradient with respect to
+    /// oscParams then systs, by one reverse-mode autodiff pass rather than
+    /// 2N finite-difference predictions. Evaluated at the calculator's
+    /// current parameters and the given shifts, with the calculator's
+    /// parameters left at the same values afterwards
+    double Gradient(osc::IOscCalcAdjustableStan* calc,
+                    const std::vector<StanOscParam>& oscParams,
+                    const std::vector<const ISyst*>& systs,
+                    const SystShifts& shifts,
+                    Eigen::VectorXd& grad);
+
+    /// Replace the observed bin contents, eg with a toy experiment. Must be
+    /// called before Eval if any sample in the ensemble has no data
+    void SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs);
+
+    /// -2 log likelihood ratio between expected and observed bin contents
+    static double LogLikelihood(const Eigen::Ref<const Eigen::ArrayXd>& exp,
+                                const Eigen::Ref<const Eigen::ArrayXd>& obs);
+
+    const Ensemble& GetEnsemble() const { return fEnsemble; };
+
+    /// Concatenated observed bin contents, in ensemble order
+    const Eigen::ArrayXd& Observed() const { return fObs; };
+    /// Concatenated expected bin contents from the last call to Eval
+    const Eigen::ArrayXd& Expected() const { return fExp; };
+
+  protected:
+
+    /// Sum of o ln(o) - o over observed bins, which doesn't depend on the
+    /// prediction and so is only computed once
+    static double ObservedTerm(const Eigen::Ref<const Eigen::ArrayXd>& obs);
+
+    const Ensemble& fEnsemble;
+
+    std::vector<size_t> fOffsets;
+
+    Eigen::ArrayXd fObs;
+    Eigen::ArrayXd fCosmic;
+    Eigen::ArrayXd fExp;
+    double fObsTerm;
+    bool fHasObs;
+
+  }; // class PoissonLikelihood
+
+  /// Chi-squared r^T V^-1 r over the concatenated bins of every sample in an
+  /// Ensemble, with r the observed minus expected bin contents. V is in
+  /// ensemble order, ie each sample's GetBinning() bins at its Offset().
+  /// The Cholesky factor of V is computed once and cached under the
+  /// ensemble ID and the contents of V, so further instances for the same
+  /// ensemble and matrix (eg one per thread) share it. Each evaluation is then one triangular solve.
+  /// Holds a reference to the ensemble, which must outlive it
+  class CovarianceChi2 {
+
+  public:
+
+    /// Factorise cov for this ensemble, or reuse the cached factor if the
+    /// same matrix has already been factorised for it
+    CovarianceChi2(const Ensemble& ensemble, const Eigen::MatrixXd& cov);
+    /// Reuse the cached factor for this ensemble's ID, which must be the
+    /// only one cached for it and must match its number of bins
+    CovarianceChi2(const Ensemble& ensemble);
+
+    double Eval(osc::IOscCalc* calc, const SystShifts& shifts=kNoShift);
+
+    /// Chi-squared for a residual in ensemble bin order
+    double Chi2(const Eigen::Ref<const Eigen::ArrayXd>& resid);
+
+    void SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs);
+
+    /// Scale sample i's rows and columns of V by scale, eg the ratio of new
+    /// to old POT for a covariance in absolute event counts. That only
+    /// scales rows of the Cholesky factor, so costs O(bins^2) at most
+    void ScaleSample(size_t i, double scale);
+
+    /// Add sigma * U U^T to V, one rank-1 update of the factor per column
+    /// of U. Negative sigma downdates, which fails if V stops being
+    /// positive definite
+    void RankUpdate(const Eigen::MatrixXd& u, double sigma=1);
+
+    /// Lower Cholesky factor of the current covariance
+    const Eigen::MatrixXd& CholeskyL() const { return *fL; };
+    /// Current covariance, rebuilt from the factor
+    Eigen::MatrixXd Covariance() const;
+
+    const Ensemble& GetEnsemble() const { return fEnsemble; };
+    const Eigen::ArrayXd& Observed() const { return fObs; };
+    const Eigen::ArrayXd& Expected() const { return fExp; };
+
+    /// Drop every cached factor
+    static void ClearCache();
+
+  protected:
+
+    CovarianceChi2(const Ensemble& ensemble, std::shared_ptr<Eigen::MatrixXd> l);
+
+    /// Factorise cov and cache the factor under the ensemble's ID and a
+    /// hash of cov, unless an identical matrix is already cached
+    static std::shared_ptr<Eigen::MatrixXd> Factorise(const Ensemble& ensemble,
+                                                            const Eigen::MatrixXd& cov);
+    static std::shared_ptr<Eigen::MatrixXd> Cached(const Ensemble& ensemble);
+
+    /// |L^-1 r|^2 for the residual r already in fResid, solving in place
+    double SolveResid();
+
+    /// Copy the factor before changing it if any other instance shares it
+    Eigen::MatrixXd& MutableL();
+
+    const Ensemble& fEnsemble;
+
+    std::vector<size_t> fOffsets;
+
+    std::shared_ptr<Eigen::MatrixXd> fL;
+
+    Eigen::ArrayXd fObs;
+    Eigen::ArrayXd fCosmic;
+    Eigen::ArrayXd fExp;
+    Eigen::VectorXd fResid;
+    bool fHasObs;
+
+  }; // class CovarianceChi2
+
+} // namespace pisces
@@ -0,0 +1,35 @@
+#include "Core/MappedFile.h"
+#include "Core/Sample.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pisces {
+
+  //---------------------------------------------------------------------------
+  MappedFile::MappedFile(const std::string& fname)
+    : fName(fname), fData(nullptr), fSize(0)
+  {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) Error("failed to open file "+fname);
+    struct stat st;
+    if (fstat(fd, &st) != 0) Error("failed to stat file "+fname);
+    fSize = st.st_size;
+    if (fSize) {
+      void* ptr = mmap(nullptr, fSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED) Error("failed to map file "+fname);
+      fData = (const char*)ptr;
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+  } // MappedFile constructor
+
+  //---------------------------------------------------------------------------
+  MappedFile::~MappedFile()
+  {
+    if (fData) munmap((void*)fData, fSize);
+  } // MappedFile destructor
+
+} // namespace pisces
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+namespace pisces {
+
+  /// Read-only memory mapping of a whole file, unmapped on destruction
+  class MappedFile {
+
+  public:
+
+    MappedFile(const std::string& fname);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const std::string& Name() const { return fName; };
+    const char* Data() const { return fData; };
+    size_t Size() const { return fSize; };
+
+  protected:
+
+    std::string fName;
+    const char* fData;
+    size_t fSize;
+
+  }; // class MappedFile
+
+} // namespace pisces
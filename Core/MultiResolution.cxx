@@ -0,0 +1,249 @@
+#include "Core/MultiResolution.h"
+#include "Core/Likelihood.h"
+#include "Core/PredictionTensor.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace pisces {
+
+  using namespace ana;
+
+  //---------------------------------------------------------------------------
+  BinGrouping::BinGrouping(const Binning& fine, size_t factor)
+  {
+    if (!factor) Error("bin merging factor must be positive");
+    const std::vector<double>& edges = fine.Edges();
+    size_t n = fine.NBins();
+    for (size_t i = 0; i < n; i += factor) {
+      fStarts.push_back(i);
+      fEdges.push_back(edges[i]);
+    }
+    fStarts.push_back(n);
+    fEdges.push_back(edges[n]);
+  } // BinGrouping constructor
+
+  //---------------------------------------------------------------------------
+  BinGrouping::BinGrouping(const Binning& fine, const std::vector<double>& edges)
+    : fEdges(edges)
+  {
+    const std::vector<double>& fineEdges = fine.Edges();
+    if (edges.size() < 2) Error("coarse binning needs at least one bin");
+    size_t j = 0;
+    for (double edge : edges) {
+      double tol = 1e-9 * std::max(1., std::abs(edge));
+      while (j < fineEdges.size() && fineEdges[j] < edge - tol) ++j;
+      if (j == fineEdges.size() || std::abs(fineEdges[j] - edge) > tol)
+        Error("coarse bin edge "+std::to_string(edge)+" isn't a native bin edge");
+      fStarts.push_back(j);
+    } // for edge
+    if (fStarts.front() != 0 || fStarts.back() != size_t(fine.NBins()))
+      Error("coarse binning must cover the same range as the native binning");
+  } // BinGrouping constructor
+
+  //---------------------------------------------------------------------------
+  HistAxis BinGrouping::GetAxis(const Sample& s) const
+  {
+    if (size_t(s.GetBinning().NBins()) != NFineBins())
+      Error("bin grouping doesn't match the binning of sample "+s.Name());
+    return HistAxis(s.GetAxis().GetLabels()[0], GetBinning(), s.GetVar());
+  } // function BinGrouping::GetAxis
+
+  //---------------------------------------------------------------------------
+  void BinGrouping::Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine,
+                          Eigen::Ref<Eigen::ArrayXd> coarse) const
+  {
+    if (size_t(fine.size()) != NFineBins() || size_t(coarse.size()) != NCoarseBins())
+      Error("bin contents don't match bin grouping");
+    for (size_t i = 0; i < NCoarseBins(); ++i)
+      coarse(i) = fine.segment(fStarts[i], fStarts[i+1]-fStarts[i]).sum();
+  } // function BinGrouping::Merge
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd BinGrouping::Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine) const
+  {
+    Eigen::ArrayXd ret(NCoarseBins());
+    Merge(fine, ret);
+    return ret;
+  } // function BinGrouping::Merge
+
+  //---------------------------------------------------------------------------
+  Spectrum BinGrouping::Merge(const Sample& s, const Spectrum& fine) const
+  {
+    // Keep the underflow and overflow bins as they are
+    Eigen::ArrayXd arr = fine.GetEigen(fine.POT());
+    Eigen::ArrayXd tmp(NCoarseBins()+2);
+    tmp(0) = arr(0);
+    tmp(NCoarseBins()+1) = arr(arr.size()-1);
+    Merge(arr.segment(1, NFineBins()), tmp.segment(1, NCoarseBins()));
+    return Spectrum(std::move(tmp), GetAxis(s), fine.POT(), fine.Livetime());
+  } // function BinGrouping::Merge
+
+  //---------------------------------------------------------------------------
+  CoarseLikelihood::CoarseLikelihood(const Ensemble& ensemble,
+                                     const std::vector<BinGrouping>& groupings)
+    : fEnsemble(ensemble), fGroupings(groupings)
+  {
+    if (fGroupings.size() != fEnsemble.size())
+      Error("need one bin grouping per sample in ensemble "+fEnsemble.ID());
+    fOffsets.push_back(0);
+    for (size_t i = 0; i <= fEnsemble.size(); ++i) fFineOffsets.push_back(fEnsemble.Offset(i));
+    for (size_t i = 0; i < fEnsemble.size(); ++i) {
+      if (fGroupings[i].NFineBins() != fFineOffsets[i+1] - fFineOffsets[i])
+        Error("bin grouping doesn't match the binning of sample "+fEnsemble[i].Name());
+      fOffsets.push_back(fOffsets.back() + fGroupings[i].NCoarseBins());
+    }
+
+    // Merge tensor responses once here, rather than every prediction
+    std::vector<Sample> rest;
+    for (size_t i = 0; i < fEnsemble.size(); ++i) {
+      if (std::shared_ptr<PredictionTensor> tensor = fEnsemble.Tensor(i)) {
+        fTensors.push_back(MergeTensor(*tensor, fEnsemble[i], fGroupings[i]));
+        fTensors.back()->Register(fProbs);
+      } else {
+        fTensors.push_back(nullptr);
+        rest.push_back(fEnsemble[i]);
+        fRestIndex.push_back(i);
+      }
+    } // for sample
+    if (!rest.empty()) {
+      fRest.reset(new Ensemble(rest));
+      for (size_t j = 0; j <= rest.size(); ++j) fRestOffsets.push_back(fRest->Offset(j));
+      fRestFine = Eigen::ArrayXd::Zero(fRestOffsets.back());
+    }
+
+    fFine = Eigen::ArrayXd::Zero(fEnsemble.NBins());
+    fExp = Eigen::ArrayXd::Zero(NBins());
+    fCosmic = Eigen::ArrayXd::Zero(NBins());
+    fObs = Eigen::ArrayXd::Zero(NBins());
+    Merge(fEnsemble.Cosmics(), fCosmic);
+
+    fHasObs = true;
+    for (size_t i = 0; i < fEnsemble.size(); ++i) {
+      const Sample& s = fEnsemble[i];
+      if (s.HasData())
+        fGroupings[i].Merge(s.ToArray(s.Data()),
+                            fObs.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]));
+      else fHasObs = false;
+    } // for sample
+  } // CoarseLikelihood constructor
+
+  //---------------------------------------------------------------------------
+  CoarseLikelihood::CoarseLikelihood(const Ensemble& ensemble, size_t factor)
+    : CoarseLikelihood(ensemble, [&ensemble, factor]() {
+        std::vector<BinGrouping> ret;
+        for (const Sample& s : ensemble) ret.emplace_back(s.GetBinning(), factor);
+        return ret;
+      }())
+  {} // CoarseLikelihood constructor
+
+  //---------------------------------------------------------------------------
+  void CoarseLikelihood::Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine,
+                               Eigen::Ref<Eigen::ArrayXd> coarse) const
+  {
+    if (size_t(fine.size()) != fEnsemble.NBins() || size_t(coarse.size()) != NBins())
+      Error("bin contents don't match ensemble "+fEnsemble.ID());
+    for (size_t i = 0; i < fGroupings.size(); ++i)
+      fGroupings[i].Merge(fine.segment(fFineOffsets[i], fGroupings[i].NFineBins()),
+                          coarse.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]));
+  } // function CoarseLikelihood::Merge
+
+  //---------------------------------------------------------------------------
+  void CoarseLikelihood::SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs)
+  {
+    Merge(obs, fObs);
+    fHasObs = true;
+  } // function CoarseLikelihood::SetObserved
+
+  //---------------------------------------------------------------------------
+  double CoarseLikelihood::Eval(osc::IOscCalc* calc, const SystShifts& shifts)
+  {
+    if (!fHasObs) Error("no observed data set for ensemble "+fEnsemble.ID());
+
+    // Tensors only predict at nominal shifts, so anything else goes the
+    // long way round, as it would without merging
+    bool anyTensor = false, nominal = shifts.IsNominal();
+    for (size_t i = 0; i < fTensors.size(); ++i) {
+      if (!fTensors[i]) continue;
+      anyTensor = true;
+      if (!nominal && !fEnsemble[i].IsNominal(shifts)) {
+        EvalFine(calc, shifts);
+        return PoissonLikelihood::LogLikelihood(fExp, fObs);
+      }
+    } // for sample
+
+    if (anyTensor) {
+      fProbs.Fill(calc);
+      for (size_t i = 0; i < fTensors.size(); ++i) {
+        if (!fTensors[i]) continue;
+        fTensors[i]->OscWeights(fProbs, fW);
+        fTensors[i]->PredictInto(fExp.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]),
+                                 fW, fEnsemble[i].POT());
+      }
+    }
+    if (fRest) {
+      fRest->PredictInto(fRestFine, calc, shifts);
+      for (size_t j = 0; j < fRestIndex.size(); ++j) {
+        size_t i = fRestIndex[j];
+        fGroupings[i].Merge(fRestFine.segment(fRestOffsets[j], fGroupings[i].NFineBins()),
+                            fExp.segment(fOffsets[i], fOffsets[i+1]-fOffsets[i]));
+      }
+    }
+    fExp += fCosmic;
+    return PoissonLikelihood::LogLikelihood(fExp, fObs);
+  } // function CoarseLikelihood::Eval
+
+  //---------------------------------------------------------------------------
+  void CoarseLikelihood::EvalFine(osc::IOscCalc* calc, const SystShifts& shifts)
+  {
+    fEnsemble.PredictInto(fFine, calc, shifts);
+    Merge(fFine, fExp);
+    fExp += fCosmic;
+  } // function CoarseLikelihood::EvalFine
+
+  //---------------------------------------------------------------------------
+  std::unique_ptr<PredictionTensor> CoarseLikelihood::MergeTensor(const PredictionTensor& fine,
+                                                                  const Sample& s,
+                                                                  const BinGrouping& grouping)
+  {
+    Sample coarse = s;
+    coarse.SetAxis(grouping.GetAxis(s));
+    const std::vector<size_t>& starts = grouping.Starts();
+
+    std::vector<Eigen::MatrixXd> responses;
+    auto merge = [&](const Eigen::Ref<const Eigen::MatrixXd>& resp) {
+      Eigen::MatrixXd r(grouping.NCoarseBins(), fine.NTrueBins());
+      for (size_t i = 0; i < grouping.NCoarseBins(); ++i)
+        r.row(i) = resp.middleRows(starts[i], starts[i+1]-starts[i]).colwise().sum();
+      responses.push_back(r);
+    };
+    // Double-precision responses are read in place, others decoded once
+    for (size_t c = 0; c < fine.NChannels(); ++c) {
+      if (fine.Precision() == kDoublePrecision) merge(fine.ResponseView(c));
+      else merge(fine.Response(c));
+    } // for channel
+
+    const Eigen::ArrayXd& edges = fine.TrueEdges();
+    Binning trueBins = Binning::Custom(std::vector<double>(edges.data(), edges.data()+edges.size()));
+    std::unique_ptr<PredictionTensor> ret(new PredictionTensor(coarse, trueBins, responses, fine.POT()));
+    ret->SetPrecision(fine.Precision());
+    return ret;
+  } // function CoarseLikelihood::MergeTensor
+
+  //---------------------------------------------------------------------------
+  double CoarseToFineFit(const Ensemble& ensemble, const std::vector<size_t>& factors,
+                         const Minimiser& minimiser, osc::IOscCalcAdjustable* calc,
+                         SystShifts& shifts)
+  {
+    // Each pass starts from wherever the last one left calc and shifts
+    for (size_t factor : factors) {
+      CoarseLikelihood coarse(ensemble, factor);
+      minimiser([&coarse](osc::IOscCalc* c, const SystShifts& s) { return coarse.Eval(c, s); },
+                calc, shifts);
+    }
+    PoissonLikelihood fine(ensemble);
+    return minimiser([&fine](osc::IOscCalc* c, const SystShifts& s) { return fine.Eval(c, s); },
+                     calc, shifts);
+  } // function CoarseToFineFit
+
+} // namespace pisces
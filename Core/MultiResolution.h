@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+#include "Core/OscProbTable.h"
+
+#include "CAFAna/Core/Binning.h"
+
+#include <Eigen/Dense>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Grouping of a sample's native bins into contiguous coarse bins.
+  /// Coarse contents are sums of the native ones, so anything already
+  /// predicted on the native binning can be merged without predicting again
+  class BinGrouping {
+
+  public:
+
+    /// Merge every factor consecutive bins, with any remainder in the last
+    /// coarse bin
+    BinGrouping(const Binning& fine, size_t factor);
+    /// Merge onto coarse edges, which must be a subset of the fine edges
+    /// covering the same range
+    BinGrouping(const Binning& fine, const std::vector<double>& edges);
+
+    size_t NFineBins()   const { return fStarts.back(); };
+    size_t NCoarseBins() const { return fStarts.size() - 1; };
+    /// First native bin of each coarse bin, with the total appended
+    const std::vector<size_t>& Starts() const { return fStarts; };
+
+    Binning GetBinning() const { return Binning::Custom(fEdges); };
+    /// Sample s's axis on the coarse binning
+    HistAxis GetAxis(const Sample& s) const;
+
+    /// Sum fine bin contents (without underflow and overflow) into coarse
+    void Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine,
+               Eigen::Ref<Eigen::ArrayXd> coarse) const;
+    Eigen::ArrayXd Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine) const;
+    /// Coarse view of one of sample s's spectra, eg its data or prediction
+    Spectrum Merge(const Sample& s, const Spectrum& fine) const;
+
+  protected:
+
+    std::vector<double> fEdges;
+    std::vector<size_t> fStarts;
+
+  }; // class BinGrouping
+
+  class PredictionTensor;
+
+  /// Poisson likelihood of an ensemble evaluated on coarse bins. Samples
+  /// with tensor predictions have their response rows merged once, up
+  /// front, and are predicted straight onto the coarse bins. The rest are
+  /// predicted on their native binning as usual, then merged. Either way
+  /// the result is compared to the merged data. Like PoissonLikelihood,
+  /// each thread needs its own instance, and the ensemble's samples are
+  /// taken as they are at construction
+  class CoarseLikelihood {
+
+  public:
+
+    /// One grouping per sample, in ensemble order
+    CoarseLikelihood(const Ensemble& ensemble, const std::vector<BinGrouping>& groupings);
+    /// Merge every factor bins in every sample
+    CoarseLikelihood(const Ensemble& ensemble, size_t factor);
+
+    double Eval(osc::IOscCalc* calc, const SystShifts& shifts=kNoShift);
+
+    /// Replace the observed bin contents, given on the native binning
+    void SetObserved(const Eigen::Ref<const Eigen::ArrayXd>& obs);
+
+    size_t NBins() const { return fOffsets.back(); };
+    /// Whether sample i is predicted from a coarse tensor
+    bool IsCoarseTensor(size_t i) const { return bool(fTensors[i]); };
+    const std::vector<BinGrouping>& Groupings() const { return fGroupings; };
+    /// Merge concatenated native bins of the ensemble into coarse ones
+    void Merge(const Eigen::Ref<const Eigen::ArrayXd>& fine,
+               Eigen::Ref<Eigen::ArrayXd> coarse) const;
+
+    const Eigen::ArrayXd& Observed() const { return fObs; };
+    const Eigen::ArrayXd& Expected() const { return fExp; };
+
+    /// Copy of fine with its reco bins merged by grouping, for a sample
+    /// whose native binning the grouping matches
+    static std::unique_ptr<PredictionTensor> MergeTensor(const PredictionTensor& fine,
+                                                         const Sample& s,
+                                                         const BinGrouping& grouping);
+
+  protected:
+
+    /// Every sample on the native binning, for when some tensor-backed
+    /// sample isn't nominal at the shifts being evaluated
+    void EvalFine(osc::IOscCalc* calc, const SystShifts& shifts);
+
+    const Ensemble& fEnsemble;
+    std::vector<BinGrouping> fGroupings;
+    /// Coarse and native offsets of each sample's bins
+    std::vector<size_t> fOffsets;
+    std::vector<size_t> fFineOffsets;
+
+    /// Merged tensors (nullptr for other samples), and the probability
+    /// table and weights they're predicted with
+    std::vector<std::shared_ptr<PredictionTensor>> fTensors;
+    OscProbTable fProbs;
+    Eigen::MatrixXd fW;
+    /// Samples without tensors, predicted natively into fRestFine
+    std::unique_ptr<Ensemble> fRest;
+    std::vector<size_t> fRestIndex;
+    std::vector<size_t> fRestOffsets;
+    Eigen::ArrayXd fRestFine;
+
+    Eigen::ArrayXd fFine;
+    Eigen::ArrayXd fCosmic;
+    Eigen::ArrayXd fObs;
+    Eigen::ArrayXd fExp;
+    bool fHasObs;
+
+  }; // class CoarseLikelihood
+
+  /// Test statistic to minimise, as a function of the fit parameters
+  typedef std::function<double(osc::IOscCalc* calc, const SystShifts& shifts)> FitStatistic;
+  /// Minimiser, which starts from calc and shifts, leaves them at the best
+  /// fit and returns the minimum
+  typedef std::function<double(const FitStatistic& stat, osc::IOscCalcAdjustable* calc,
+                               SystShifts& shifts)> Minimiser;
+
+  /// Fit on successively finer binnings, each warm-started from the best
+  /// fit of the last. factors are the bin merging factors of the coarse
+  /// passes, coarsest first. The final pass is always on the native
+  /// binnings, using the full PoissonLikelihood. Returns its minimum
+  double CoarseToFineFit(const Ensemble& ensemble, const std::vector<size_t>& factors,
+                         const Minimiser& minimiser, osc::IOscCalcAdjustable* calc,
+                         SystShifts& shifts);
+
+} // namespace pisces
@@ -0,0 +1,49 @@
+#include "Core/OscCalcPool.h"
+#include "Core/Sample.h"
+
+#include "TMD5.h"
+
+namespace pisces {
+
+  //---------------------------------------------------------------------------
+  OscCalcPool::OscCalcPool(const osc::IOscCalc* master)
+    : fMaster(master), fGeneration(1)
+  {
+    if (!fMaster) Error("oscillation calculator pool needs a master calculator");
+    fMasterHash = ParamsHash(fMaster);
+  } // OscCalcPool constructor
+
+  //---------------------------------------------------------------------------
+  std::string OscCalcPool::ParamsHash(const osc::IOscCalc* calc)
+  {
+    std::unique_ptr<TMD5> hash(calc->GetParamsHash());
+    return hash ? hash->AsString() : "";
+  } // function OscCalcPool::ParamsHash
+
+  //---------------------------------------------------------------------------
+  osc::IOscCalc* OscCalcPool::Local()
+  {
+    Clone& clone = fClones.local();
+    // A fresh clone starts at generation zero, so always gets copied here
+    size_t gen = fGeneration;
+    if (clone.generation != gen) {
+      clone.calc.reset(fMaster->Copy());
+      clone.generation = gen;
+    }
+    return clone.calc.get();
+  } // function OscCalcPool::Local
+
+  //---------------------------------------------------------------------------
+  void OscCalcPool::SetMaster(const osc::IOscCalc* master)
+  {
+    if (!master) Error("oscillation calculator pool needs a master calculator");
+    // Leases hand the same calculator back on every call, so only recopy
+    // the clones when it's really different
+    std::string hash = ParamsHash(master);
+    if (master == fMaster && !hash.empty() && hash == fMasterHash) return;
+    fMaster = master;
+    fMasterHash = hash;
+    Sync();
+  } // function OscCalcPool::SetMaster
+
+} // namespace pisces
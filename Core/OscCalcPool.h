@@ -0,0 +1,57 @@
+#pragma once
+
+#include "OscLib/IOscCalc.h"
+
+#include "tbb/enumerable_thread_specific.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace pisces {
+
+  /// Per-thread clones of a master oscillation calculator. Calculators cache
+  /// internal state, so two threads can't safely share one; instead each
+  /// thread asks the pool for its own copy, which is kept in step with the
+  /// master. Clones are made lazily, the first time a thread needs one
+  class OscCalcPool {
+
+  public:
+
+    OscCalcPool(const osc::IOscCalc* master);
+
+    /// This thread's clone, recopied from the master if it's changed since
+    /// the clone was made. Safe to call from any number of threads at once
+    osc::IOscCalc* Local();
+
+    /// Mark every clone out of date, after changing the master's parameters.
+    /// The master mustn't change, and this mustn't be called, while other
+    /// threads are using the pool
+    void Sync() { ++fGeneration; };
+    /// Switch to a different master, marking every clone out of date unless
+    /// it's the same calculator with the same GetParamsHash() as before.
+    /// Calculators without a hash always count as changed
+    void SetMaster(const osc::IOscCalc* master);
+
+    const osc::IOscCalc* Master() const { return fMaster; };
+    /// Number of threads that have taken a clone so far
+    size_t NClones() const { return fClones.size(); };
+
+  protected:
+
+    struct Clone {
+      std::unique_ptr<osc::IOscCalc> calc;
+      size_t generation = 0;
+    };
+
+    /// The master's parameter hash when it was last set, empty if it has none
+    static std::string ParamsHash(const osc::IOscCalc* calc);
+
+    const osc::IOscCalc* fMaster;
+    std::string fMasterHash;
+    std::atomic<size_t> fGeneration;
+    tbb::enumerable_thread_specific<Clone> fClones;
+
+  }; // class OscCalcPool
+
+} // namespace pisces
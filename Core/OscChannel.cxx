@@ -8,38 +8,45 @@ namespace pisces {
   using namespace ana;
 
   //---------------------------------------------------------------------------
-  OscChannel::OscChannel(const std::string& name)
-    : fName(name), fFlavour(Flavors::kAll), fCurrent(Current::kBoth),
-      fSign(Sign::kBoth), fCut(kNoCut)
+  const Cut& oscchan::ChannelCut(size_t id)
+  {
+    static const std::vector<Cut> cuts = []() {
+      std::vector<Cut> ret;
+      for (size_t i = 0; i < kFlavCuts.size(); ++i)
+        for (size_t j = 0; j < kSignCuts.size(); ++j)
+          ret.push_back(kFlavCuts[i] && kSignCuts[j]);
+      ret.push_back(kIsNC);
+      return ret;
+    }();
+    return cuts.at(id);
+  } // function oscchan::ChannelCut
+
+  //---------------------------------------------------------------------------
+  OscChannel::OscChannel(size_t id)
+    : fID(id), fCut(kNoCut)
   {
-    // Add each combination of flavour and sign
-    for (size_t i = 0; i < oscchan::kFlavNames.size(); ++i) {
-      for (size_t j = 0; j < oscchan::kSignNames.size(); ++j) {
-        if (name == OscChannel::CCName(i,j)) {
-          fFlavour = oscchan::kFlavours[i];
-          fCurrent = Current::kCC;
-          fSign = oscchan::kSigns[j];
-          fCut = oscchan::kFlavCuts[i] && oscchan::kSignCuts[j];
-          fConfig = oscchan::kSwapConfigs[i];
-          fFrom = pow(-1, j) * oscchan::kInitFlav[i];
-          fTo = pow(-1, j) * oscchan::kFinalFlav[i];
-          return;
-        } // if name matches
-      } // for flavour
-    } // for sign
-    if (name == OscChannel::NCName()) {
-      fFlavour = Flavors::kAll;
-      fCurrent = Current::kNC;
-      fSign = Sign::kBoth;
-      fCut = kIsNC;
-      fConfig = Loaders::kNonSwap;
-      fFrom = 12;
-      fTo = 0;
-      return;
-    }
-    assert(false && ("Sample "+name+" not recognised!").c_str());
+    assert(id < oscchan::kChannels.size() && "Channel ID not recognised!");
+    const oscchan::ChannelInfo& info = oscchan::kChannels.at(id);
+    fName = info.name;
+    fFlavour = info.flav;
+    fCurrent = info.curr;
+    fSign = info.sign;
+    fCut = oscchan::ChannelCut(id);
+    fConfig = info.config;
+    fFrom = info.from;
+    fTo = info.to;
   } // OscChannel constructor
 
+  //---------------------------------------------------------------------------
+  OscChannel::OscChannel(const std::string& name)
+    : OscChannel([&name]() {
+        for (size_t i = 0; i < oscchan::kChannels.size(); ++i)
+          if (oscchan::kChannels[i].name == name) return i;
+        assert(false && ("Sample "+name+" not recognised!").c_str());
+        return oscchan::kChannels.size();
+      }())
+  {} // OscChannel constructor
+
   //---------------------------------------------------------------------------
   void OscChannel::SaveTo(TDirectory* dir, const std::string& name) const
   {
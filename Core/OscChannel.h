@@ -6,6 +6,8 @@
 
 #include <Eigen/Dense>
 
+#include <string_view>
+
 namespace pisces {
 
   using namespace ana;
@@ -54,6 +56,47 @@ namespace pisces {
     const std::array<std::string, 2> kSignNames { "nu", "nubar" };
     const std::array<Sign::Sign_t, 2> kSigns { Sign::kNu, Sign::kAntiNu };
     const std::array<Cut, 2> kSignCuts { !kIsAntiNu, kIsAntiNu };
+
+    /// Compile-time description of a single oscillation channel
+    struct ChannelInfo {
+      std::string_view        name;
+      Flavors::Flavors_t      flav;
+      Current::Current_t      curr;
+      Sign::Sign_t            sign;
+      Loaders::SwappingConfig config;
+      int                     from;
+      int                     to;
+    };
+
+    /// Every oscillation channel, indexed by channel ID. CC channels are
+    /// ordered by flavour then sign, so CC index = 2*flavour + sign, and the
+    /// neutral current channel comes last
+    constexpr std::array<ChannelInfo, 13> kChannels
+    {{
+      { "cc_nu_nuetonue",       Flavors::kNuEToNuE,    Current::kCC, Sign::kNu,     Loaders::kNonSwap,    12,  12 },
+      { "cc_nubar_nuetonue",    Flavors::kNuEToNuE,    Current::kCC, Sign::kAntiNu, Loaders::kNonSwap,   -12, -12 },
+      { "cc_nu_numutonumu",     Flavors::kNuMuToNuMu,  Current::kCC, Sign::kNu,     Loaders::kNonSwap,    14,  14 },
+      { "cc_nubar_numutonumu",  Flavors::kNuMuToNuMu,  Current::kCC, Sign::kAntiNu, Loaders::kNonSwap,   -14, -14 },
+      { "cc_nu_nuetonumu",      Flavors::kNuEToNuMu,   Current::kCC, Sign::kNu,     Loaders::kNueSwap,    12,  14 },
+      { "cc_nubar_nuetonumu",   Flavors::kNuEToNuMu,   Current::kCC, Sign::kAntiNu, Loaders::kNueSwap,   -12, -14 },
+      { "cc_nu_nuetonutau",     Flavors::kNuEToNuTau,  Current::kCC, Sign::kNu,     Loaders::kNuTauSwap,  12,  16 },
+      { "cc_nubar_nuetonutau",  Flavors::kNuEToNuTau,  Current::kCC, Sign::kAntiNu, Loaders::kNuTauSwap, -12, -16 },
+      { "cc_nu_numutonue",      Flavors::kNuMuToNuE,   Current::kCC, Sign::kNu,     Loaders::kNueSwap,    14,  12 },
+      { "cc_nubar_numutonue",   Flavors::kNuMuToNuE,   Current::kCC, Sign::kAntiNu, Loaders::kNueSwap,   -14, -12 },
+      { "cc_nu_numutonutau",    Flavors::kNuMuToNuTau, Current::kCC, Sign::kNu,     Loaders::kNuTauSwap,  14,  16 },
+      { "cc_nubar_numutonutau", Flavors::kNuMuToNuTau, Current::kCC, Sign::kAntiNu, Loaders::kNuTauSwap, -14, -16 },
+      { "nc",                   Flavors::kAll,         Current::kNC, Sign::kBoth,   Loaders::kNonSwap,    12,   0 }
+    }};
+    constexpr size_t kNCChannel = kChannels.size() - 1;
+
+    /// Channel IDs present at each detector. Only the unoscillated beam
+    /// flavours are simulated at the near detector
+    constexpr std::array<size_t, 5>  kNDChannels { 0, 1, 2, 3, kNCChannel };
+    constexpr std::array<size_t, 13> kFDChannels { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, kNCChannel };
+
+    /// Truth cut for a channel ID. Built on first use, since the cuts it's
+    /// made from are defined in another library
+    const Cut& ChannelCut(size_t id);
   } // namespace oscchan
 
   class OscChannel {
@@ -61,8 +104,11 @@ namespace pisces {
   public:
 
     OscChannel(const std::string& name);
+    explicit OscChannel(size_t id);
     ~OscChannel() {};
 
+    /// Get channel ID, the index of this channel in oscchan::kChannels
+    size_t ID() const { return fID; };
     /// Get name of oscillation channel
     std::string Name() const { return fName; };
     /// Get flavour of oscillation channel
@@ -88,9 +134,10 @@ namespace pisces {
 
   protected:
 
-    static std::string CCName(size_t f, size_t s) { return "cc_"+oscchan::kSignNames[s]+"_"+oscchan::kFlavNames[f]; };
-    static std::string NCName() { return "nc"; };
+    static std::string CCName(size_t f, size_t s) { return std::string(oscchan::kChannels[2*f+s].name); };
+    static std::string NCName() { return std::string(oscchan::kChannels[oscchan::kNCChannel].name); };
 
+    size_t                     fID;
     std::string                fName;
     Flavors::Flavors_t         fFlavour;
     Current::Current_t         fCurrent;
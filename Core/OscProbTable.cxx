@@ -0,0 +1,61 @@
+#include "Core/OscProbTable.h"
+#include "Core/Sample.h"
+
+#include <functional>
+#include <string_view>
+
+namespace pisces {
+
+  //---------------------------------------------------------------------------
+  void OscProbTable::Add(int from, int to, const Eigen::ArrayXd& energies)
+  {
+    size_t grid = FindGrid(energies);
+    if (grid == fGrids.size()) {
+      fGrids.push_back(energies);
+      fGridIndex.emplace(Hash(energies), grid);
+    }
+    Key key { from, to, grid };
+    if (!fProbs.count(key)) fProbs[key] = Eigen::ArrayXd::Zero(energies.size());
+  } // function OscProbTable::Add
+
+  //---------------------------------------------------------------------------
+  void OscProbTable::Fill(osc::IOscCalc* calc)
+  {
+    for (auto& [key, probs] : fProbs) {
+      const auto& [from, to, grid] = key;
+      const Eigen::ArrayXd& energies = fGrids[grid];
+      for (Eigen::Index i = 0; i < energies.size(); ++i)
+        probs(i) = calc->P(from, to, energies(i));
+    } // for transition
+  } // function OscProbTable::Fill
+
+  //---------------------------------------------------------------------------
+  const Eigen::ArrayXd& OscProbTable::P(int from, int to,
+                                        const Eigen::ArrayXd& energies) const
+  {
+    auto it = fProbs.find(Key(from, to, FindGrid(energies)));
+    if (it == fProbs.end())
+      Error("transition "+std::to_string(from)+" to "+std::to_string(to)
+            +" not registered in oscillation probability table");
+    return it->second;
+  } // function OscProbTable::P
+
+  //---------------------------------------------------------------------------
+  size_t OscProbTable::FindGrid(const Eigen::ArrayXd& energies) const
+  {
+    auto [begin, end] = fGridIndex.equal_range(Hash(energies));
+    for (auto it = begin; it != end; ++it) {
+      const Eigen::ArrayXd& grid = fGrids[it->second];
+      if (grid.size() == energies.size() && (grid == energies).all()) return it->second;
+    }
+    return fGrids.size();
+  } // function OscProbTable::FindGrid
+
+  //---------------------------------------------------------------------------
+  size_t OscProbTable::Hash(const Eigen::ArrayXd& energies)
+  {
+    return std::hash<std::string_view>()(std::string_view((const char*)energies.data(),
+                                                          energies.size()*sizeof(double)));
+  } // function OscProbTable::Hash
+
+} // namespace pisces
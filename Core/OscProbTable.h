@@ -0,0 +1,50 @@
+#pragma once
+
+#include "OscLib/IOscCalc.h"
+
+#include <Eigen/Dense>
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace pisces {
+
+  /// Table of oscillation probabilities per (from, to, true energy bin),
+  /// shared between every sample and channel that use the same energy
+  /// grid. Register the grids and flavour transitions needed, then Fill()
+  /// evaluates each distinct transition once per parameter point
+  class OscProbTable {
+
+  public:
+
+    /// Register a transition on an energy grid. Identical grids are shared
+    void Add(int from, int to, const Eigen::ArrayXd& energies);
+
+    /// Evaluate every registered transition with this calculator
+    void Fill(osc::IOscCalc* calc);
+
+    /// Probabilities for a registered transition, as of the last Fill()
+    const Eigen::ArrayXd& P(int from, int to, const Eigen::ArrayXd& energies) const;
+
+    size_t NGrids()       const { return fGrids.size(); };
+    size_t NTransitions() const { return fProbs.size(); };
+
+  protected:
+
+    /// Index of an energy grid, or NGrids() if it isn't registered
+    size_t FindGrid(const Eigen::ArrayXd& energies) const;
+    static size_t Hash(const Eigen::ArrayXd& energies);
+
+    typedef std::tuple<int, int, size_t> Key;
+
+    std::vector<Eigen::ArrayXd> fGrids;
+    /// Grids by a hash of their contents, so a lookup only compares
+    /// against grids that are almost certainly the one wanted
+    std::unordered_multimap<size_t, size_t> fGridIndex;
+    std::map<Key, Eigen::ArrayXd> fProbs;
+
+  }; // class OscProbTable
+
+} // namespace pisces
@@ -0,0 +1,45 @@
+#include "Core/PredictionCache.h"
+
+#include "TMD5.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+namespace pisces {
+
+  using namespace ana;
+
+  //---------------------------------------------------------------------------
+  bool PredictionKey::Make(osc::IOscCalc* calc, const SystShifts& shifts,
+                           PredictionKey& key)
+  {
+    key.osc.clear();
+    if (calc) {
+      // Calculators that can't hash their parameters can't be cached
+      std::unique_ptr<TMD5> hash(calc->GetParamsHash());
+      if (!hash) return false;
+      key.osc = hash->AsString();
+    }
+
+    // Sort by syst so the key doesn't depend on the order systs were set in
+    key.shifts.clear();
+    for (const ISyst* syst : shifts.ActiveSysts())
+      key.shifts.emplace_back(syst, shifts.GetShift(syst));
+    std::sort(key.shifts.begin(), key.shifts.end());
+    return true;
+  } // function PredictionKey::Make
+
+  //---------------------------------------------------------------------------
+  size_t PredictionKeyHash::operator()(const PredictionKey& key) const
+  {
+    size_t ret = std::hash<std::string>()(key.osc);
+    auto combine = [&ret](size_t h) { ret ^= h + 0x9e3779b9 + (ret << 6) + (ret >> 2); };
+    for (const auto& [syst, val] : key.shifts) {
+      combine(std::hash<const ISyst*>()(syst));
+      combine(std::hash<double>()(val));
+    }
+    return ret;
+  } // function PredictionKeyHash::operator()
+
+} // namespace pisces
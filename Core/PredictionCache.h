@@ -0,0 +1,99 @@
+#pragma once
+
+#include "CAFAna/Core/SystShifts.h"
+
+#include "OscLib/IOscCalc.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Key identifying a prediction: the oscillation parameters and the
+  /// (already alias-remapped) systematic shifts it was evaluated at
+  struct PredictionKey {
+
+    std::string osc;
+    std::vector<std::pair<const ISyst*, double>> shifts;
+
+    bool operator==(const PredictionKey& rhs) const
+    {
+      return osc == rhs.osc && shifts == rhs.shifts;
+    }
+
+    /// Build a key, returning false if the calculator can't provide a hash.
+    /// A null calc leaves the oscillation part empty, for predictions that
+    /// don't depend on the oscillation parameters
+    static bool Make(osc::IOscCalc* calc, const SystShifts& shifts,
+                     PredictionKey& key);
+
+  }; // struct PredictionKey
+
+  struct PredictionKeyHash {
+    size_t operator()(const PredictionKey& key) const;
+  }; // struct PredictionKeyHash
+
+  /// Size-bounded, thread-safe least-recently-used cache of predictions
+  template<class T> class PredictionCache {
+
+  public:
+
+    PredictionCache(size_t capacity) : fCapacity(capacity) {};
+
+    size_t Capacity() const { return fCapacity; };
+    size_t Hits()     const { std::lock_guard<std::mutex> l(fMutex); return fHits;   };
+    size_t Misses()   const { std::lock_guard<std::mutex> l(fMutex); return fMisses; };
+
+    /// Copy cached value into ret and return true, or return false on a
+    /// miss. ret can be anything T assigns to, such as an Eigen::Ref into a
+    /// caller-owned buffer, so a hit needn't allocate
+    template<class U> bool Get(const PredictionKey& key, U&& ret)
+    {
+      std::lock_guard<std::mutex> l(fMutex);
+      auto it = fIndex.find(key);
+      if (it == fIndex.end()) {
+        ++fMisses;
+        return false;
+      }
+      // Move this entry to the front of the queue
+      fEntries.splice(fEntries.begin(), fEntries, it->second);
+      ++fHits;
+      ret = it->second->second;
+      return true;
+    } // function PredictionCache::Get
+
+    void Put(const PredictionKey& key, const T& val)
+    {
+      std::lock_guard<std::mutex> l(fMutex);
+      if (fIndex.count(key) || !fCapacity) return;
+      fEntries.emplace_front(key, val);
+      fIndex.emplace(key, fEntries.begin());
+      // Evict least recently used entries once we're over capacity
+      while (fEntries.size() > fCapacity) {
+        fIndex.erase(fEntries.back().first);
+        fEntries.pop_back();
+      }
+    } // function PredictionCache::Put
+
+  protected:
+
+    typedef std::list<std::pair<PredictionKey, T>> EntryList;
+
+    size_t fCapacity;
+    size_t fHits = 0;
+    size_t fMisses = 0;
+
+    EntryList fEntries;
+    std::unordered_map<PredictionKey, typename EntryList::iterator, PredictionKeyHash> fIndex;
+
+    mutable std::mutex fMutex;
+
+  }; // class PredictionCache
+
+} // namespace pisces
@@ -0,0 +1,236 @@
+#include "Core/PredictionStore.h"
+#include "Core/Sample.h"
+
+#include "CAFAna/Core/LoadFromFile.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace pisces {
+
+  using namespace ana;
+
+  //---------------------------------------------------------------------------
+  PredictionHandle::PredictionHandle(Loader loader, size_t bytes,
+                                     std::shared_ptr<IPrediction> pred)
+    : fLoader(loader), fBytes(bytes), fPred(pred)
+  {} // PredictionHandle constructor
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<PredictionHandle> PredictionHandle::Lazy(Loader loader, size_t bytes)
+  {
+    if (!loader) Error("lazy prediction needs a loader");
+    return std::shared_ptr<PredictionHandle>(new PredictionHandle(loader, bytes, nullptr));
+  } // function PredictionHandle::Lazy
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<PredictionHandle> PredictionHandle::Lazy(const std::string& fname,
+                                                           const std::string& label,
+                                                           size_t bytes)
+  {
+    return Lazy([fname, label]() { return LoadFromFile<IPrediction>(fname, label); }, bytes);
+  } // function PredictionHandle::Lazy
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<PredictionHandle> PredictionHandle::Resident(std::shared_ptr<IPrediction> pred)
+  {
+    return std::shared_ptr<PredictionHandle>(new PredictionHandle(nullptr, 0, pred));
+  } // function PredictionHandle::Resident
+
+  //---------------------------------------------------------------------------
+  PredictionHandle::~PredictionHandle()
+  {
+    if (fLoader) PredictionStore::Instance().Removed(this);
+  } // PredictionHandle destructor
+
+  //---------------------------------------------------------------------------
+  std::shared_ptr<IPrediction> PredictionHandle::Get()
+  {
+    if (!fLoader) return fPred;
+
+    // Already loaded is by far the most common case, and takes no locks
+    std::shared_ptr<IPrediction> ret = std::atomic_load(&fPred);
+    if (ret) {
+      Stamp();
+      return ret;
+    }
+
+    PredictionStore& store = PredictionStore::Instance();
+    std::vector<std::shared_ptr<PredictionHandle>> evict;
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      // Another thread may have loaded it while we waited
+      ret = std::atomic_load(&fPred);
+      if (ret) {
+        Stamp();
+        return ret;
+      }
+      ret = fLoader();
+      if (!ret) Error("lazy prediction loader returned nothing");
+      Stamp();
+      std::atomic_store(&fPred, ret);
+      evict = store.Loaded(shared_from_this());
+    }
+    // Evict outside our own lock, so two loading handles can't deadlock
+    for (const std::shared_ptr<PredictionHandle>& h : evict) h->Drop();
+    return ret;
+  } // function PredictionHandle::Get
+
+  //---------------------------------------------------------------------------
+  bool PredictionHandle::IsLoaded() const
+  {
+    return bool(std::atomic_load(&fPred));
+  } // function PredictionHandle::IsLoaded
+
+  //---------------------------------------------------------------------------
+  void PredictionHandle::Evict()
+  {
+    if (!fLoader) return;
+    std::lock_guard<std::mutex> lock(fMutex);
+    std::atomic_store(&fPred, std::shared_ptr<IPrediction>());
+    PredictionStore::Instance().Removed(this);
+  } // function PredictionHandle::Evict
+
+  //---------------------------------------------------------------------------
+  void PredictionHandle::Drop()
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    if (!PredictionStore::Instance().IsTracked(this))
+      std::atomic_store(&fPred, std::shared_ptr<IPrediction>());
+  } // function PredictionHandle::Drop
+
+  //---------------------------------------------------------------------------
+  void PredictionHandle::Stamp()
+  {
+    // A clock rather than a shared counter, so concurrent readers don't
+    // all write to the same cache line
+    fLastUsed.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                    std::memory_order_relaxed);
+  } // function PredictionHandle::Stamp
+
+  //---------------------------------------------------------------------------
+  PredictionStore& PredictionStore::Instance()
+  {
+    // Leaked, since static handles elsewhere may outlive a static store
+    static PredictionStore* store = new PredictionStore;
+    return *store;
+  } // function PredictionStore::Instance
+
+  //---------------------------------------------------------------------------
+  void PredictionStore::SetBudget(size_t bytes)
+  {
+    std::vector<std::shared_ptr<PredictionHandle>> evict;
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fBudget = bytes;
+      evict = OverBudget(nullptr);
+    }
+    for (const std::shared_ptr<PredictionHandle>& h : evict) h->Drop();
+  } // function PredictionStore::SetBudget
+
+  //---------------------------------------------------------------------------
+  size_t PredictionStore::Budget() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fBudget;
+  } // function PredictionStore::Budget
+
+  //---------------------------------------------------------------------------
+  size_t PredictionStore::Resident() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fResident;
+  } // function PredictionStore::Resident
+
+  //---------------------------------------------------------------------------
+  size_t PredictionStore::NLoaded() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fEntries.size();
+  } // function PredictionStore::NLoaded
+
+  //---------------------------------------------------------------------------
+  size_t PredictionStore::NLoads() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fLoads;
+  } // function PredictionStore::NLoads
+
+  //---------------------------------------------------------------------------
+  size_t PredictionStore::NEvictions() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fEvictions;
+  } // function PredictionStore::NEvictions
+
+  //---------------------------------------------------------------------------
+  void PredictionStore::Clear()
+  {
+    std::vector<std::shared_ptr<PredictionHandle>> evict;
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      for (const auto& [key, e] : fEntries)
+        if (std::shared_ptr<PredictionHandle> h = e.handle.lock()) evict.push_back(h);
+      fEvictions += fEntries.size();
+      fEntries.clear();
+      fResident = 0;
+    }
+    for (const std::shared_ptr<PredictionHandle>& h : evict) h->Drop();
+  } // function PredictionStore::Clear
+
+  //---------------------------------------------------------------------------
+  bool PredictionStore::IsTracked(const PredictionHandle* h) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return fEntries.count(h);
+  } // function PredictionStore::IsTracked
+
+  //---------------------------------------------------------------------------
+  std::vector<std::shared_ptr<PredictionHandle>>
+  PredictionStore::Loaded(std::shared_ptr<PredictionHandle> h)
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    if (!fEntries.count(h.get())) {
+      fEntries[h.get()] = { h, h->Bytes() };
+      fResident += h->Bytes();
+      ++fLoads;
+    }
+    return OverBudget(h.get());
+  } // function PredictionStore::Loaded
+
+  //---------------------------------------------------------------------------
+  void PredictionStore::Removed(const PredictionHandle* h)
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    auto it = fEntries.find(h);
+    if (it == fEntries.end()) return;
+    fResident -= it->second.bytes;
+    fEntries.erase(it);
+  } // function PredictionStore::Removed
+
+  //---------------------------------------------------------------------------
+  std::vector<std::shared_ptr<PredictionHandle>>
+  PredictionStore::OverBudget(const PredictionHandle* keep)
+  {
+    std::vector<std::shared_ptr<PredictionHandle>> ret;
+    if (!fBudget || fResident <= fBudget) return ret;
+    // Least recently used first. Handles being destroyed wait on our lock
+    // in Removed, so every key here still points at a live object. The
+    // handle just loaded stays even if it alone is over budget, since the
+    // caller is about to use it
+    std::vector<std::pair<int64_t, const PredictionHandle*>> order;
+    for (const auto& [key, e] : fEntries)
+      if (key != keep) order.emplace_back(key->fLastUsed.load(std::memory_order_relaxed), key);
+    std::sort(order.begin(), order.end());
+    for (const auto& [stamp, key] : order) {
+      if (fResident <= fBudget) break;
+      auto it = fEntries.find(key);
+      if (std::shared_ptr<PredictionHandle> h = it->second.handle.lock()) ret.push_back(h);
+      fResident -= it->second.bytes;
+      fEntries.erase(it);
+      ++fEvictions;
+    }
+    return ret;
+  } // function PredictionStore::OverBudget
+
+} // namespace pisces
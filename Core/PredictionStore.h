@@ -0,0 +1,131 @@
+#pragma once
+
+#include "CAFAna/Prediction/IPrediction.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Handle to a sample's prediction, which may not be in memory yet.
+  /// Lazy handles call their loader on first access, and can be evicted by
+  /// the PredictionStore and reloaded later. Handles built from an existing
+  /// prediction are always resident
+  class PredictionHandle : public std::enable_shared_from_this<PredictionHandle> {
+
+  public:
+
+    typedef std::function<std::unique_ptr<IPrediction>()> Loader;
+
+    /// Lazy handle. bytes is the memory the prediction takes once loaded,
+    /// which is what counts against the store's budget
+    static std::shared_ptr<PredictionHandle> Lazy(Loader loader, size_t bytes);
+    /// Lazy handle reading label from a ROOT file
+    static std::shared_ptr<PredictionHandle> Lazy(const std::string& fname,
+                                                  const std::string& label,
+                                                  size_t bytes);
+    /// Resident handle, which is never evicted
+    static std::shared_ptr<PredictionHandle> Resident(std::shared_ptr<IPrediction> pred);
+
+    ~PredictionHandle();
+
+    /// The prediction, loading it first if needed. The returned pointer
+    /// keeps the prediction alive even if it's evicted in the meantime.
+    /// Takes no locks when the prediction is already loaded
+    std::shared_ptr<IPrediction> Get();
+
+    bool IsLoaded() const;
+    bool IsLazy() const { return bool(fLoader); };
+    size_t Bytes() const { return fBytes; };
+
+    /// Drop the prediction if it's lazy, so it's reloaded on next access
+    void Evict();
+
+  protected:
+
+    PredictionHandle(Loader loader, size_t bytes, std::shared_ptr<IPrediction> pred);
+
+    /// Drop the prediction on the store's behalf, unless it's been reloaded
+    /// since the store chose to evict it
+    void Drop();
+    /// Record that the prediction was just used
+    void Stamp();
+
+    Loader fLoader;
+    size_t fBytes;
+
+    /// Serialises loading and evicting. fPred itself is only read and
+    /// written with the atomic shared_ptr functions, so Get can return a
+    /// loaded prediction without taking this
+    mutable std::mutex fMutex;
+    std::shared_ptr<IPrediction> fPred;
+    /// Time of the last Get, which orders evictions
+    std::atomic<int64_t> fLastUsed{0};
+
+    friend class PredictionStore;
+
+  }; // class PredictionHandle
+
+  /// Tracks which lazy predictions are loaded, and evicts the least recently
+  /// used ones once their total size goes over a memory budget. Handles
+  /// stamp their own last use, so reading a loaded prediction never touches
+  /// the store, and recency is only sorted out when something is evicted
+  class PredictionStore {
+
+  public:
+
+    /// Never destroyed, so handles in other static objects can still
+    /// reach it on their way out
+    static PredictionStore& Instance();
+
+    /// Budget in bytes. Zero means unlimited, which is the default
+    void SetBudget(size_t bytes);
+    size_t Budget() const;
+    /// Bytes taken up by loaded lazy predictions
+    size_t Resident() const;
+    size_t NLoaded() const;
+    size_t NLoads() const;
+    size_t NEvictions() const;
+
+    /// Evict every lazy prediction
+    void Clear();
+
+  protected:
+
+    PredictionStore() = default;
+
+    bool IsTracked(const PredictionHandle* h) const;
+    /// Record that h was just loaded, and return whatever needs evicting to
+    /// get back under budget. Evicting is left to the caller so no handle
+    /// lock is ever taken while holding the store's lock
+    std::vector<std::shared_ptr<PredictionHandle>> Loaded(std::shared_ptr<PredictionHandle> h);
+    void Removed(const PredictionHandle* h);
+    /// Untrack least recently used handles, other than keep, until back
+    /// under budget
+    std::vector<std::shared_ptr<PredictionHandle>> OverBudget(const PredictionHandle* keep);
+
+    mutable std::mutex fMutex;
+    size_t fBudget = 0;
+    size_t fResident = 0;
+    size_t fLoads = 0;
+    size_t fEvictions = 0;
+    struct Entry {
+      std::weak_ptr<PredictionHandle> handle;
+      size_t bytes;
+    };
+    /// Loaded lazy handles
+    std::unordered_map<const PredictionHandle*, Entry> fEntries;
+
+    friend class PredictionHandle;
+
+  }; // class PredictionStore
+
+} // namespace pisces
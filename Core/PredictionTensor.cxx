@@ -0,0 +1,340 @@
+#include "Core/PredictionTensor.h"
+#include "Core/Snapshot.h"
+
+#include <algorithm>
+
+namespace pisces {
+
+  using namespace ana;
+
+  //---------------------------------------------------------------------------
+  PredictionTensor::PredictionTensor(const Sample& s, const Binning& trueBins,
+                                     const std::vector<Eigen::MatrixXd>& responses,
+                                     double pot)
+    : fAxis(s.GetAxis()), fPOT(pot), fChannels(s.AllChannels()),
+      fResponse(nullptr, 0, 0)
+  {
+    size_t nReco = s.GetBinning().NBins(), nTrue = trueBins.NBins();
+    if (responses.size() != fChannels.size())
+      Error("expected one response matrix per channel for sample "+s.Name());
+
+    // Lay the channels out side by side in one contiguous matrix
+    auto owned = std::make_shared<Eigen::MatrixXd>(nReco, fChannels.size()*nTrue);
+    for (size_t c = 0; c < responses.size(); ++c) {
+      if (size_t(responses[c].rows()) != nReco || size_t(responses[c].cols()) != nTrue)
+        Error("response matrix for channel "+fChannels[c].Name()+" has the wrong shape in sample "+s.Name());
+      owned->middleCols(c*nTrue, nTrue) = responses[c];
+    }
+
+    const std::vector<double>& edges = trueBins.Edges();
+    SetResponse(Eigen::Map<const Eigen::ArrayXd>(edges.data(), edges.size()),
+                owned, owned->data(), nReco);
+  } // PredictionTensor constructor
+
+  //---------------------------------------------------------------------------
+  PredictionTensor::PredictionTensor(const Sample& s, const Eigen::ArrayXd& trueEdges,
+                                     std::shared_ptr<const void> owner,
+                                     const double* response, double pot)
+    : fAxis(s.GetAxis()), fPOT(pot), fChannels(s.AllChannels()),
+      fResponse(nullptr, 0, 0)
+  {
+    SetResponse(trueEdges, owner, response, s.GetBinning().NBins());
+  } // PredictionTensor constructor
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::SetResponse(const Eigen::ArrayXd& trueEdges,
+                                     std::shared_ptr<const void> owner,
+                                     const double* response, size_t nReco)
+  {
+    fTrueEdges = trueEdges;
+    size_t nTrue = fTrueEdges.size() - 1;
+    fTrueEnergies = 0.5 * (fTrueEdges.head(nTrue) + fTrueEdges.tail(nTrue));
+    fOwner = owner;
+    fNReco = nReco;
+    // Eigen's recommended way to point an existing Map at new memory
+    new (&fResponse) Eigen::Map<const Eigen::MatrixXd>(response, nReco, fChannels.size()*nTrue);
+  } // function PredictionTensor::SetResponse
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::Predict(osc::IOscCalc* calc) const
+  {
+    Eigen::ArrayXd ret(NRecoBins());
+    PredictInto(ret, OscWeights(calc), fPOT);
+    return ToSpectrum(ret);
+  } // function PredictionTensor::Predict
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::Predict(const OscProbTable& probs) const
+  {
+    Eigen::ArrayXd ret(NRecoBins());
+    PredictInto(ret, OscWeights(probs), fPOT);
+    return ToSpectrum(ret);
+  } // function PredictionTensor::Predict
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::PredictComponent(osc::IOscCalc* calc,
+                                              Flavors::Flavors_t flav,
+                                              Current::Current_t curr,
+                                              Sign::Sign_t sign) const
+  {
+    Eigen::MatrixXd w = OscWeights(calc);
+    for (size_t c = 0; c < fChannels.size(); ++c) {
+      const OscChannel& ch = fChannels[c];
+      if (!((ch.Flav() & flav) && (ch.Curr() & curr) && (ch.Sign() & sign)))
+        w.col(c).setZero();
+    }
+    Eigen::ArrayXd ret(NRecoBins());
+    PredictInto(ret, w, fPOT);
+    return ToSpectrum(ret);
+  } // function PredictionTensor::PredictComponent
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::PredictSyst(osc::IOscCalc* calc,
+                                         const SystShifts& shifts) const
+  {
+    if (!shifts.IsNominal())
+      Error("prediction tensor can't apply syst shifts, only nominal predictions are supported");
+    return Predict(calc);
+  } // function PredictionTensor::PredictSyst
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::PredictComponentSyst(osc::IOscCalc* calc,
+                                                  const SystShifts& shifts,
+                                                  Flavors::Flavors_t flav,
+                                                  Current::Current_t curr,
+                                                  Sign::Sign_t sign) const
+  {
+    if (!shifts.IsNominal())
+      Error("prediction tensor can't apply syst shifts, only nominal predictions are supported");
+    return PredictComponent(calc, flav, curr, sign);
+  } // function PredictionTensor::PredictComponentSyst
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd PredictionTensor::PredictAllChannels(osc::IOscCalc* calc) const
+  {
+    return ByChannel(OscWeights(calc));
+  } // function PredictionTensor::PredictAllChannels
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd PredictionTensor::PredictAllChannels(const OscProbTable& probs) const
+  {
+    return ByChannel(OscWeights(probs));
+  } // function PredictionTensor::PredictAllChannels
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::Register(OscProbTable& probs) const
+  {
+    for (const OscChannel& ch : fChannels)
+      if (ch.Curr() != Current::kNC) probs.Add(ch.From(), ch.To(), fTrueEnergies);
+  } // function PredictionTensor::Register
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd PredictionTensor::OscWeights(osc::IOscCalc* calc) const
+  {
+    Eigen::MatrixXd ret;
+    OscWeights(calc, ret);
+    return ret;
+  } // function PredictionTensor::OscWeights
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd PredictionTensor::OscWeights(const OscProbTable& probs) const
+  {
+    Eigen::MatrixXd ret;
+    OscWeights(probs, ret);
+    return ret;
+  } // function PredictionTensor::OscWeights
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::OscWeights(osc::IOscCalc* calc, Eigen::MatrixXd& w) const
+  {
+    w.resize(NTrueBins(), fChannels.size());
+    for (size_t c = 0; c < fChannels.size(); ++c) {
+      const OscChannel& ch = fChannels[c];
+      // Neutral currents don't oscillate
+      if (ch.Curr() == Current::kNC) {
+        w.col(c).setOnes();
+        continue;
+      }
+      for (size_t i = 0; i < NTrueBins(); ++i)
+        w(i, c) = calc->P(ch.From(), ch.To(), fTrueEnergies(i));
+    } // for channel
+  } // function PredictionTensor::OscWeights
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::OscWeights(const OscProbTable& probs, Eigen::MatrixXd& w) const
+  {
+    w.resize(NTrueBins(), fChannels.size());
+    for (size_t c = 0; c < fChannels.size(); ++c) {
+      const OscChannel& ch = fChannels[c];
+      if (ch.Curr() == Current::kNC) w.col(c).setOnes();
+      else w.col(c) = probs.P(ch.From(), ch.To(), fTrueEnergies).matrix();
+    } // for channel
+  } // function PredictionTensor::OscWeights
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::PredictInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                     const Eigen::MatrixXd& w, double pot) const
+  {
+    if (size_t(out.size()) != NRecoBins()) Error("output has the wrong number of bins for prediction tensor");
+    // Weights are column-major, so flattened they line up with the channel
+    // blocks of the response and the total is a single product
+    Product(out, w.data(), 0, w.size());
+    out *= pot / fPOT;
+  } // function PredictionTensor::PredictInto
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd PredictionTensor::ByChannel(const Eigen::MatrixXd& w) const
+  {
+    Eigen::ArrayXXd ret(fChannels.size(), NRecoBins());
+    Eigen::ArrayXd row(NRecoBins());
+    for (size_t c = 0; c < fChannels.size(); ++c) {
+      Product(row, w.col(c).data(), c*NTrueBins(), NTrueBins());
+      ret.row(c) = row.transpose();
+    }
+    return ret;
+  } // function PredictionTensor::ByChannel
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::Product(Eigen::Ref<Eigen::ArrayXd> out, const double* w,
+                                 size_t first, size_t n) const
+  {
+    if (fPrecision == kDoublePrecision) {
+      out.matrix().noalias() = fResponse.middleCols(first, n) * Eigen::Map<const Eigen::VectorXd>(w, n);
+      return;
+    }
+    // Reduced precision is widened one column at a time, so the sum is
+    // still done in double without decoding the whole response
+    out.setZero();
+    for (size_t j = 0; j < n; ++j) {
+      if (!w[j]) continue;
+      if (fPrecision == kSinglePrecision)
+        out += w[j] * fResponseF.col(first+j).cast<double>().array();
+      else out += (w[j] * fScale(first+j)) * fResponseQ.col(first+j).cast<double>().array();
+    }
+  } // function PredictionTensor::Product
+
+  //---------------------------------------------------------------------------
+  Eigen::MatrixXd PredictionTensor::Response(size_t c) const
+  {
+    size_t first = c*NTrueBins(), n = NTrueBins();
+    if (fPrecision == kSinglePrecision)
+      return fResponseF.middleCols(first, n).cast<double>();
+    if (fPrecision == kQuantized16)
+      return fResponseQ.middleCols(first, n).cast<double>() * fScale.segment(first, n).asDiagonal();
+    return fResponse.middleCols(first, n);
+  } // function PredictionTensor::Response
+
+  //---------------------------------------------------------------------------
+  Eigen::Ref<const Eigen::MatrixXd> PredictionTensor::ResponseView(size_t c) const
+  {
+    if (fPrecision != kDoublePrecision)
+      Error("prediction tensor response can only be viewed in place at double precision");
+    return fResponse.middleCols(c*NTrueBins(), NTrueBins());
+  } // function PredictionTensor::ResponseView
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::SetPrecision(TensorPrecision p)
+  {
+    if (p == fPrecision) return;
+    size_t nCols = fChannels.size()*NTrueBins();
+    Eigen::MatrixXd full(fNReco, nCols);
+    for (size_t c = 0; c < fChannels.size(); ++c)
+      full.middleCols(c*NTrueBins(), NTrueBins()) = Response(c);
+
+    fResponseF.resize(0, 0);
+    fResponseQ.resize(0, 0);
+    fScale.resize(0);
+    if (p == kDoublePrecision) {
+      auto owned = std::make_shared<Eigen::MatrixXd>(std::move(full));
+      fOwner = owned;
+      new (&fResponse) Eigen::Map<const Eigen::MatrixXd>(owned->data(), fNReco, nCols);
+    } else {
+      if (p == kSinglePrecision) fResponseF = full.cast<float>();
+      else {
+        // Scale each column so its largest magnitude maps to the int16 limit
+        fScale = full.cwiseAbs().colwise().maxCoeff().transpose() / 32767.;
+        Eigen::VectorXd inv = (fScale.array() > 0).select(fScale.cwiseInverse(), 0.);
+        fResponseQ = (full * inv.asDiagonal()).array().round().cast<int16_t>();
+      }
+      // Let go of the double response, whether owned or mapped
+      fOwner.reset();
+      new (&fResponse) Eigen::Map<const Eigen::MatrixXd>(nullptr, 0, 0);
+    }
+    fPrecision = p;
+  } // function PredictionTensor::SetPrecision
+
+  //---------------------------------------------------------------------------
+  size_t PredictionTensor::Bytes() const
+  {
+    if (fPrecision == kSinglePrecision) return fResponseF.size() * sizeof(float);
+    if (fPrecision == kQuantized16)
+      return fResponseQ.size() * sizeof(int16_t) + fScale.size() * sizeof(double);
+    return fResponse.size() * sizeof(double);
+  } // function PredictionTensor::Bytes
+
+  //---------------------------------------------------------------------------
+  PrecisionReport PredictionTensor::Compare(const PredictionTensor& test,
+                                            const PredictionTensor& ref,
+                                            const std::vector<osc::IOscCalc*>& calcs)
+  {
+    if (test.NRecoBins() != ref.NRecoBins() || test.NChannels() != ref.NChannels()
+        || test.NTrueBins() != ref.NTrueBins())
+      Error("prediction tensors being compared have different shapes");
+    PrecisionReport ret { 0, 0 };
+    Eigen::MatrixXd w;
+    Eigen::ArrayXd a(ref.NRecoBins()), b(ref.NRecoBins());
+    for (osc::IOscCalc* calc : calcs) {
+      ref.OscWeights(calc, w);
+      ref.PredictInto(a, w, ref.POT());
+      test.PredictInto(b, w, ref.POT());
+      Eigen::ArrayXd diff = (b - a).abs();
+      ret.maxAbs = std::max(ret.maxAbs, diff.maxCoeff());
+      ret.maxRel = std::max(ret.maxRel, (a > 0).select(diff / a, 0.).maxCoeff());
+    }
+    return ret;
+  } // function PredictionTensor::Compare
+
+  //---------------------------------------------------------------------------
+  void PredictionTensor::AddTo(SnapshotWriter& writer, const Sample& s) const
+  {
+    if (fPrecision == kDoublePrecision) {
+      writer.AddTensor(s, "tensor_response",
+                       Eigen::Map<const Eigen::ArrayXXd>(fResponse.data(),
+                                                         fResponse.rows(), fResponse.cols()));
+    } else {
+      // Snapshots only hold doubles, so reduced precisions are decoded first
+      Eigen::ArrayXXd response(NRecoBins(), NChannels()*NTrueBins());
+      for (size_t c = 0; c < NChannels(); ++c)
+        response.middleCols(c*NTrueBins(), NTrueBins()) = Response(c).array();
+      writer.AddTensor(s, "tensor_response", response);
+    }
+    writer.AddTensor(s, "tensor_true_edges", fTrueEdges);
+    writer.AddTensor(s, "tensor_pot", Eigen::ArrayXd::Constant(1, fPOT));
+  } // function PredictionTensor::AddTo
+
+  //---------------------------------------------------------------------------
+  std::unique_ptr<PredictionTensor> PredictionTensor::FromSnapshot(const Snapshot& snap,
+                                                                   const Sample& s)
+  {
+    Eigen::Map<const Eigen::ArrayXXd> edges = snap.Tensor(s, "tensor_true_edges");
+    Eigen::Map<const Eigen::ArrayXXd> response = snap.Tensor(s, "tensor_response");
+    double pot = snap.Tensor(s, "tensor_pot")(0, 0);
+
+    size_t nTrue = edges.size() - 1;
+    if (size_t(response.rows()) != size_t(s.GetBinning().NBins())
+        || size_t(response.cols()) != s.AllChannels().size()*nTrue)
+      Error("prediction tensor in snapshot has the wrong shape for sample "+s.Name());
+
+    return std::unique_ptr<PredictionTensor>(
+      new PredictionTensor(s, edges.col(0), snap.File(), response.data(), pot));
+  } // function PredictionTensor::FromSnapshot
+
+  //---------------------------------------------------------------------------
+  Spectrum PredictionTensor::ToSpectrum(const Eigen::ArrayXd& arr) const
+  {
+    Eigen::ArrayXd tmp = Eigen::ArrayXd::Zero(arr.size()+2);
+    tmp.segment(1, arr.size()) = arr;
+    return Spectrum(std::move(tmp), fAxis, fPOT, 0);
+  } // function PredictionTensor::ToSpectrum
+
+} // namespace pisces
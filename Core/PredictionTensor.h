@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Core/OscProbTable.h"
+#include "Core/Sample.h"
+
+#include "CAFAna/Core/Binning.h"
+
+#include <Eigen/Dense>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace pisces {
+
+  class Snapshot;
+  class SnapshotWriter;
+
+  using namespace ana;
+
+  /// How a PredictionTensor stores its response. Reduced precisions save
+  /// memory and cache, and are still accumulated in double
+  enum TensorPrecision {
+    kDoublePrecision,
+    kSinglePrecision,
+    kQuantized16 // int16 with one scale per column
+  };
+
+  /// Largest deviation of predicted bin contents from a reference
+  struct PrecisionReport {
+    double maxAbs; // events
+    double maxRel; // fraction of the reference bin content
+  };
+
+  /// Prediction backend storing the unoscillated response of a sample as a
+  /// dense tensor. For each channel in Sample::AllChannels() it holds a
+  /// (reco bins x true energy bins) matrix, and all channels sit side by
+  /// side in a single contiguous (reco bins x channels*true bins) matrix.
+  /// Oscillating is then one weight per (channel, true energy bin), and the
+  /// total prediction is a single matrix-vector product.
+  /// Only nominal predictions are supported
+  class PredictionTensor : public IPrediction {
+
+  public:
+
+    /// responses holds one (reco bins x true bins) matrix per channel of s,
+    /// in AllChannels() order, normalised to the given POT
+    PredictionTensor(const Sample& s, const Binning& trueBins,
+                     const std::vector<Eigen::MatrixXd>& responses, double pot);
+
+    virtual Spectrum Predict(osc::IOscCalc* calc) const override;
+    virtual Spectrum PredictComponent(osc::IOscCalc* calc,
+                                      Flavors::Flavors_t flav,
+                                      Current::Current_t curr,
+                                      Sign::Sign_t sign) const override;
+
+    /// The tensor only holds the nominal response, so these are errors for
+    /// any non-nominal shifts rather than silently ignoring them
+    using IPrediction::PredictSyst;
+    using IPrediction::PredictComponentSyst;
+    virtual Spectrum PredictSyst(osc::IOscCalc* calc,
+                                 const SystShifts& shifts) const override;
+    virtual Spectrum PredictComponentSyst(osc::IOscCalc* calc,
+                                          const SystShifts& shifts,
+                                          Flavors::Flavors_t flav,
+                                          Current::Current_t curr,
+                                          Sign::Sign_t sign) const override;
+
+    /// Predict every channel at once, as a channels x reco bins array at
+    /// the tensor's POT
+    Eigen::ArrayXXd PredictAllChannels(osc::IOscCalc* calc) const;
+
+    /// Predict using probabilities from a shared table, which must already
+    /// have this tensor registered and be filled
+    Spectrum Predict(const OscProbTable& probs) const;
+    Eigen::ArrayXXd PredictAllChannels(const OscProbTable& probs) const;
+
+    /// Register the transitions and energy grid this tensor needs
+    void Register(OscProbTable& probs) const;
+
+    /// Oscillation weights, as a true bins x channels matrix
+    Eigen::MatrixXd OscWeights(osc::IOscCalc* calc) const;
+    Eigen::MatrixXd OscWeights(const OscProbTable& probs) const;
+    /// Fill w with the oscillation weights, reusing its storage
+    void OscWeights(osc::IOscCalc* calc, Eigen::MatrixXd& w) const;
+    void OscWeights(const OscProbTable& probs, Eigen::MatrixXd& w) const;
+
+    /// Write the reco bin contents for a set of weights, scaled to pot,
+    /// into out. Zeroing columns of w selects a subset of channels. Makes
+    /// no heap allocations
+    void PredictInto(Eigen::Ref<Eigen::ArrayXd> out, const Eigen::MatrixXd& w,
+                     double pot) const;
+
+    double POT() const { return fPOT; };
+    size_t NChannels() const { return fChannels.size(); };
+    size_t NTrueBins() const { return fTrueEnergies.size(); };
+    size_t NRecoBins() const { return fNReco; };
+    const Eigen::ArrayXd& TrueEnergies() const { return fTrueEnergies; };
+    const Eigen::ArrayXd& TrueEdges() const { return fTrueEdges; };
+    const std::vector<OscChannel>& Channels() const { return fChannels; };
+
+    /// Copy of a single channel's response, as a reco bins x true bins
+    /// matrix, decoded to double whatever the storage precision
+    Eigen::MatrixXd Response(size_t c) const;
+    /// A single channel's response in place, without copying. Only
+    /// available at double precision
+    Eigen::Ref<const Eigen::MatrixXd> ResponseView(size_t c) const;
+
+    /// Convert the stored response, freeing the old copy. Going back to
+    /// double doesn't recover the precision lost. This only covers the
+    /// nominal templates: tensors hold no syst splines, so coefficients
+    /// of any spline-based prediction stay in double
+    void SetPrecision(TensorPrecision p);
+    TensorPrecision Precision() const { return fPrecision; };
+    /// Memory taken by the stored response
+    size_t Bytes() const;
+
+    /// Largest deviation of test's predictions from ref's, which should be
+    /// a double-precision copy, over a set of oscillation parameters
+    static PrecisionReport Compare(const PredictionTensor& test,
+                                   const PredictionTensor& ref,
+                                   const std::vector<osc::IOscCalc*>& calcs);
+
+    /// Store the tensor alongside sample s in a snapshot
+    void AddTo(SnapshotWriter& writer, const Sample& s) const;
+    /// Load the tensor for sample s from a snapshot without copying. The
+    /// tensor keeps the snapshot's mapping alive
+    static std::unique_ptr<PredictionTensor> FromSnapshot(const Snapshot& snap,
+                                                          const Sample& s);
+
+  protected:
+
+    PredictionTensor(const Sample& s, const Eigen::ArrayXd& trueEdges,
+                     std::shared_ptr<const void> owner, const double* response,
+                     double pot);
+
+    void SetResponse(const Eigen::ArrayXd& trueEdges,
+                     std::shared_ptr<const void> owner,
+                     const double* response, size_t nReco);
+    Spectrum ToSpectrum(const Eigen::ArrayXd& arr) const;
+    /// Per-channel predictions for a set of weights
+    Eigen::ArrayXXd ByChannel(const Eigen::MatrixXd& w) const;
+    /// out = response columns [first, first+n) times w, in double whatever
+    /// the storage precision, with no heap allocations
+    void Product(Eigen::Ref<Eigen::ArrayXd> out, const double* w,
+                 size_t first, size_t n) const;
+
+    HistAxis fAxis;
+    double fPOT;
+    std::vector<OscChannel> fChannels;
+    Eigen::ArrayXd fTrueEdges;
+    Eigen::ArrayXd fTrueEnergies;
+
+    /// Keeps the memory behind fResponse alive, whether it's owned by this
+    /// object or memory-mapped from a snapshot
+    std::shared_ptr<const void> fOwner;
+    Eigen::Map<const Eigen::MatrixXd> fResponse;
+    size_t fNReco;
+
+    /// Reduced-precision copies of the response, only one of which (or
+    /// fResponse) is filled at a time
+    TensorPrecision fPrecision = kDoublePrecision;
+    Eigen::MatrixXf fResponseF;
+    Eigen::Matrix<int16_t, Eigen::Dynamic, Eigen::Dynamic> fResponseQ;
+    Eigen::VectorXd fScale;
+
+  }; // class PredictionTensor
+
+} // namespace pisces
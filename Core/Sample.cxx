@@ -1,6 +1,9 @@
 #include "Core/Sample.h"
+#include "Core/Instrumentation.h"
 #include "Core/OscChannel.h"
+#include "Core/PredictionTensor.h"
 
+#include <algorithm>
 #include <iostream>
 
 namespace pisces {
@@ -32,11 +35,11 @@ namespace pisces {
   //-------------------------------------------------------------------------
   Sample::Sample(unsigned int id)
   {
-    size_t offset = nBitsDet+nBitsPol, val = pow(nBitsSel,2)-1;
+    size_t offset = nBitsDet+nBitsPol, val = (1u << nBitsSel)-1;
     fSel = (Selection)((id & (val << offset)) >> offset);
-    offset = nBitsDet, val = pow(nBitsPol,2)-1;
+    offset = nBitsDet, val = (1u << nBitsPol)-1;
     fPol = (Polarity)((id & (val << offset)) >> offset);
-    val = pow(nBitsDet,2)-1;
+    val = (1u << nBitsDet)-1;
     fDet = (Detector)(id & val);
   } // Sample constructor
 
@@ -71,17 +74,11 @@ namespace pisces {
   } // function Sample::Livetime
 
   //---------------------------------------------------------------------------
-  std::vector<OscChannel> Sample::AllChannels() const
+  const std::vector<OscChannel>& Sample::AllChannels() const
   {
-    std::vector<OscChannel> ret;
-    size_t nFlavs = IsFD() ? 6 : 2;
-    // Add each combination of flavour and sign
-    for (size_t i = 0; i < nFlavs; ++i)
-      for (size_t j = 0; j < 2; ++j)
-        ret.push_back(OscChannel(OscChannel::CCName(i,j)));
-    // Add the neutral currents
-    ret.push_back(OscChannel(OscChannel::NCName()));
-    return ret;
+    static const std::vector<OscChannel> nd(oscchan::kNDChannels.begin(), oscchan::kNDChannels.end());
+    static const std::vector<OscChannel> fd(oscchan::kFDChannels.begin(), oscchan::kFDChannels.end());
+    return IsFD() ? fd : nd;
   } // function Sample::AllChannels
 
   //---------------------------------------------------------------------------
@@ -120,7 +117,18 @@ namespace pisces {
   Spectrum Sample::Predict(osc::IOscCalc* calc,
                            const SystShifts& shifts) const
   {
-    return Prediction()->PredictSyst(calc, Shifts(shifts));
+    PISCES_TIME("Sample::Predict", GetID());
+    SystShifts s = Shifts(shifts);
+    // Hold our own reference so the cache can't be swapped out under us
+    std::shared_ptr<PredictionCache<Spectrum>> cache = fCache;
+    PredictionKey key;
+    if (!cache || !MakeKey(calc, s, key, IsOscSensitive()))
+      return Prediction()->PredictSyst(calc, s);
+    Spectrum ret = Spectrum::Uninitialized();
+    if (cache->Get(key, ret)) return ret;
+    ret = Prediction()->PredictSyst(calc, s);
+    cache->Put(key, ret);
+    return ret;
   } // function Sample::Predict
 
   //---------------------------------------------------------------------------
@@ -130,43 +138,229 @@ namespace pisces {
                                     osc::IOscCalc* calc,
                                     const SystShifts& shifts) const
   {
+    PISCES_TIME("Sample::PredictComponent", GetID(), ComponentID(flav, curr, sign));
     return Prediction()->PredictComponentSyst(calc, Shifts(shifts), flav, curr, sign);
   } // function Sample::PredictComponent
 
+  //---------------------------------------------------------------------------
+  size_t Sample::ComponentID(Flavors::Flavors_t flav, Current::Current_t curr,
+                             Sign::Sign_t sign) const
+  {
+    for (const OscChannel& c : AllChannels())
+      if (c.Flav() == flav && c.Curr() == curr && c.Sign() == sign) return c.ID();
+    return Instrumentation::kNoChannel;
+  } // function Sample::ComponentID
+
   //---------------------------------------------------------------------------
   Spectrum Sample::PredictChannel(const OscChannel& channel,
                                   osc::IOscCalc* calc,
                                   const SystShifts& shifts) const
   {
-    return PredictComponent(channel.Flav(), channel.Curr(), channel.Sign(), calc, Shifts(shifts));
+    PISCES_TIME("Sample::PredictChannel", GetID(), channel.ID());
+    return PredictComponent(channel.Flav(), channel.Curr(), channel.Sign(), calc, shifts);
   } // function Sample::PredictChannel
 
   //---------------------------------------------------------------------------
   Spectrum Sample::PredictSignal(osc::IOscCalc* calc,
                                  const SystShifts& shifts) const
   {
-    Spectrum ret = Spectrum::Uninitialized();
-    for (const OscChannel& c : SignalChannels()) {
-      Spectrum spec = PredictChannel(c, calc, shifts);
-      if (!ret.NDimensions()) ret = spec;
-      else ret += spec;
-    } // for signal channel
-    return ret;
+    Eigen::ArrayXd ret(GetBinning().NBins());
+    PredictSignalInto(ret, calc, shifts);
+    return NewSpectrum(ret);
   } // function Sample::PredictSignal
 
   //---------------------------------------------------------------------------
   Spectrum Sample::PredictBackground(osc::IOscCalc* calc,
                                      const SystShifts& shifts) const
   {
-    Spectrum ret = Spectrum::Uninitialized();
-    for (const OscChannel& c : BackgroundChannels()) {
-      Spectrum spec = PredictChannel(c, calc, shifts);
-      if (!ret.NDimensions()) ret = spec;
-      else ret += spec;
-    } // for background channel
-    return ret;
+    Eigen::ArrayXd ret(GetBinning().NBins());
+    PredictBackgroundInto(ret, calc, shifts);
+    return NewSpectrum(ret);
   } // function Sample::PredictBackground
 
+  //---------------------------------------------------------------------------
+  void Sample::PredictInto(Eigen::Ref<Eigen::ArrayXd> out,
+                           osc::IOscCalc* calc,
+                           const SystShifts& shifts) const
+  {
+    PISCES_TIME("Sample::PredictInto", GetID());
+    // Skip the work entirely if nothing this sample depends on has changed
+    std::shared_ptr<PredictionCache<Eigen::ArrayXd>> cache = fArrayCache;
+    PredictionKey key;
+    bool cacheable = cache && MakeKey(calc, Shifts(shifts), key, IsOscSensitive());
+    if (cacheable && cache->Get(key, out)) return; // copies straight into out
+
+    if (std::shared_ptr<PredictionTensor> tensor = NominalTensor(shifts))
+      PredictTensorInto(*tensor, out, calc, [](const OscChannel&) { return true; });
+    else out = ToArray(Predict(calc, shifts));
+    if (cacheable) cache->Put(key, out);
+  } // function Sample::PredictInto
+
+  //---------------------------------------------------------------------------
+  void Sample::PredictChannelInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                  const OscChannel& channel,
+                                  osc::IOscCalc* calc,
+                                  const SystShifts& shifts) const
+  {
+    if (std::shared_ptr<PredictionTensor> tensor = NominalTensor(shifts))
+      PredictTensorInto(*tensor, out, calc,
+                        [&channel](const OscChannel& c) { return c.ID() == channel.ID(); });
+    else out = ToArray(PredictChannel(channel, calc, shifts));
+  } // function Sample::PredictChannelInto
+
+  //---------------------------------------------------------------------------
+  void Sample::PredictSignalInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                 osc::IOscCalc* calc,
+                                 const SystShifts& shifts) const
+  {
+    SumChannelsInto(out, calc, shifts, [this](const OscChannel& c) { return IsSignal(c); });
+  } // function Sample::PredictSignalInto
+
+  //---------------------------------------------------------------------------
+  void Sample::PredictBackgroundInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                     osc::IOscCalc* calc,
+                                     const SystShifts& shifts) const
+  {
+    SumChannelsInto(out, calc, shifts, [this](const OscChannel& c) { return !IsSignal(c); });
+  } // function Sample::PredictBackgroundInto
+
+  //---------------------------------------------------------------------------
+  template<class F> void Sample::SumChannelsInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                                 osc::IOscCalc* calc,
+                                                 const SystShifts& shifts, F keep) const
+  {
+    // Tensors, and cached predictions of every channel, cover the lot in
+    // one go
+    if (std::shared_ptr<PredictionTensor> tensor = NominalTensor(shifts)) {
+      PredictTensorInto(*tensor, out, calc, keep);
+      return;
+    }
+    std::shared_ptr<IPrediction> pred = Prediction();
+    SystShifts s = Shifts(shifts);
+    const std::vector<OscChannel>& channels = AllChannels();
+    std::shared_ptr<PredictionCache<Eigen::ArrayXXd>> cache = fChannelCache;
+    PredictionKey key;
+    Eigen::ArrayXXd all;
+    if (cache && MakeKey(calc, s, key, IsOscSensitive()) && cache->Get(key, all)) {
+      out.setZero();
+      for (size_t i = 0; i < channels.size(); ++i)
+        if (keep(channels[i])) out += all.row(i).transpose();
+      return;
+    }
+
+    // Otherwise only predict the channels wanted
+    out.setZero();
+    Eigen::ArrayXd row(out.size());
+    for (const OscChannel& c : channels) {
+      if (!keep(c)) continue;
+      PredictComponentInto(row, *pred, c, calc, s);
+      out += row;
+    }
+  } // function Sample::SumChannelsInto
+
+  //---------------------------------------------------------------------------
+  void Sample::PredictComponentInto(Eigen::Ref<Eigen::ArrayXd, 0, Eigen::InnerStride<>> out,
+                                    const IPrediction& pred, const OscChannel& c,
+                                    osc::IOscCalc* calc, const SystShifts& s) const
+  {
+    // Channels that don't oscillate are reused across oscillation steps,
+    // under a key tagged with the channel
+    std::shared_ptr<PredictionCache<Eigen::ArrayXd>> chanCache = fOscFreeChannelCache;
+    PredictionKey chanKey;
+    bool reuse = chanCache && IsOscSensitive() && !IsOscSensitive(c)
+      && MakeKey(calc, s, chanKey, false);
+    if (reuse) {
+      chanKey.osc = c.Name();
+      if (chanCache->Get(chanKey, out)) return;
+    }
+    {
+      PISCES_TIME("Sample::PredictComponent", GetID(), c.ID());
+      out = ToArray(pred.PredictComponentSyst(calc, s, c.Flav(), c.Curr(), c.Sign()));
+    }
+    if (reuse) chanCache->Put(chanKey, out);
+  } // function Sample::PredictComponentInto
+
+  //---------------------------------------------------------------------------
+  template<class F> void Sample::PredictTensorInto(const PredictionTensor& tensor,
+                                                   Eigen::Ref<Eigen::ArrayXd> out,
+                                                   osc::IOscCalc* calc, F keep) const
+  {
+    // Per-thread scratch space, which only allocates the first time round
+    thread_local Eigen::MatrixXd w;
+    tensor.OscWeights(calc, w);
+    for (size_t c = 0; c < tensor.NChannels(); ++c)
+      if (!keep(tensor.Channels()[c])) w.col(c).setZero();
+    tensor.PredictInto(out, w, POT());
+  } // function Sample::PredictTensorInto
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd Sample::PredictAllChannels(osc::IOscCalc* calc,
+                                             const SystShifts& shifts) const
+  {
+    PISCES_TIME("Sample::PredictAllChannels", GetID());
+    // Fetch the prediction and remap the systematics once for all channels
+    std::shared_ptr<IPrediction> pred = Prediction();
+    SystShifts s = Shifts(shifts);
+    std::shared_ptr<PredictionCache<Eigen::ArrayXXd>> cache = fChannelCache;
+    PredictionKey key;
+    bool cacheable = cache && MakeKey(calc, s, key, IsOscSensitive());
+    Eigen::ArrayXXd ret;
+    if (cacheable && cache->Get(key, ret)) return ret;
+
+    // Tensor predictions can do every channel in one go
+    std::shared_ptr<PredictionTensor> tensor = std::dynamic_pointer_cast<PredictionTensor>(pred);
+    if (tensor && IsNominal(shifts)) {
+      ret = tensor->PredictAllChannels(calc) * (POT() / tensor->POT());
+    } else {
+      const std::vector<OscChannel>& channels = AllChannels();
+      ret.resize(channels.size(), GetBinning().NBins());
+      for (size_t i = 0; i < channels.size(); ++i)
+        PredictComponentInto(ret.row(i).transpose(), *pred, channels[i], calc, s);
+    }
+    if (cacheable) cache->Put(key, ret);
+    return ret;
+  } // function Sample::PredictAllChannels
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd Sample::SignalMask() const
+  {
+    const std::vector<OscChannel>& channels = AllChannels();
+    Eigen::ArrayXd ret(channels.size());
+    for (size_t i = 0; i < channels.size(); ++i)
+      ret(i) = IsSignal(channels[i]) ? 1 : 0;
+    return ret;
+  } // function Sample::SignalMask
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXstan Sample::PredictStan(osc::IOscCalcStan* calc,
+                                        const SystShifts& shifts) const
+  {
+    PISCES_TIME("Sample::PredictStan", GetID());
+    Spectrum pred = Prediction()->PredictSyst(calc, Shifts(shifts));
+    // Strip underflow and overflow, as ToArray does for plain predictions
+    return pred.GetEigenStan(POT()).segment(1, GetBinning().NBins());
+  } // function Sample::PredictStan
+
+  //-------------------------------------------------------------------------
+  void Sample::SetPrediction(std::unique_ptr<IPrediction>& p)
+  {
+    fPred = PredictionHandle::Resident(std::move(p));
+    ResetCache();
+  } // function Sample::SetPrediction
+
+  //-------------------------------------------------------------------------
+  void Sample::SetPrediction(std::shared_ptr<PredictionHandle> h)
+  {
+    fPred = h;
+    ResetCache();
+  } // function Sample::SetPrediction
+
+  //-------------------------------------------------------------------------
+  void Sample::SetPrediction(const std::string& fname, const std::string& label, size_t bytes)
+  {
+    SetPrediction(PredictionHandle::Lazy(fname, label, bytes));
+  } // function Sample::SetPrediction
+
   //-------------------------------------------------------------------------
   Spectrum Sample::Data() const
   {
@@ -184,39 +378,170 @@ namespace pisces {
   //---------------------------------------------------------------------------
   Spectrum Sample::NewSpectrum(const Eigen::ArrayXd& arr) const
   {
-    Eigen::ArrayXd tmp = Eigen::ArrayXd::Zero(GetBinning().NBins()+2);
-    tmp.segment(1, GetBinning().NBins()) = arr;
+    // Only the underflow and overflow bins need zeroing
+    size_t n = GetBinning().NBins();
+    Eigen::ArrayXd tmp(n+2);
+    tmp(0) = tmp(n+1) = 0;
+    tmp.segment(1, n) = arr;
     Spectrum ret(std::move(tmp), GetAxis(), POT(), Livetime());
     return ret;
   } // function Sample::NewSpectrum
 
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXd Sample::ToArray(const Spectrum& s) const
+  {
+    // Strip the underflow and overflow bins added by NewSpectrum
+    return s.GetEigen(POT()).segment(1, GetBinning().NBins());
+  } // function Sample::ToArray
+
+  //-------------------------------------------------------------------------
+  void Sample::SetSystAlias(const ISyst* key, const ISyst* val)
+  {
+    auto it = std::lower_bound(fSystAliases.begin(), fSystAliases.end(), key,
+                               [](const auto& alias, const ISyst* syst)
+                               { return std::less<const ISyst*>()(alias.first, syst); });
+    if (it != fSystAliases.end() && it->first == key) it->second = val;
+    else fSystAliases.insert(it, { key, val });
+    // Dependencies are stored remapped, so follow the new alias
+    if (!fSystDepsRaw.empty()) SetSystDependencies(fSystDepsRaw);
+  } // function Sample::SetSystAlias
+
   //-------------------------------------------------------------------------
-  SystShifts Sample::Shifts(SystShifts shifts) const
+  void Sample::SetSystDependencies(const std::vector<const ISyst*>& systs)
   {
+    fSystDepsRaw = systs;
+    fSystDeps = Systs(systs);
+    std::sort(fSystDeps.begin(), fSystDeps.end(), std::less<const ISyst*>());
+    ResetCache();
+  } // function Sample::SetSystDependencies
+
+  //-------------------------------------------------------------------------
+  bool Sample::DependsOn(const ISyst* syst) const
+  {
+    if (fSystDepsRaw.empty()) return true;
+    return std::binary_search(fSystDeps.begin(), fSystDeps.end(), syst,
+                              std::less<const ISyst*>());
+  } // function Sample::DependsOn
+
+  //-------------------------------------------------------------------------
+  bool Sample::IsNominal(const SystShifts& shifts) const
+  {
+    for (const ISyst* syst : shifts.ActiveSysts()) {
+      const ISyst* alias = SystAlias(syst);
+      if (alias && DependsOn(alias)) return false;
+    }
+    return true;
+  } // function Sample::IsNominal
+
+  //-------------------------------------------------------------------------
+  bool Sample::MakeKey(osc::IOscCalc* calc, const SystShifts& shifts,
+                       PredictionKey& key, bool osc) const
+  {
+    if (!PredictionKey::Make(osc ? calc : nullptr, shifts, key)) return false;
+    if (!fSystDepsRaw.empty()) {
+      key.shifts.erase(std::remove_if(key.shifts.begin(), key.shifts.end(),
+                                      [this](const auto& shift) { return !DependsOn(shift.first); }),
+                       key.shifts.end());
+    }
+    return true;
+  } // function Sample::MakeKey
+
+  //-------------------------------------------------------------------------
+  const ISyst* Sample::SystAlias(const ISyst* syst) const
+  {
+    auto it = std::lower_bound(fSystAliases.begin(), fSystAliases.end(), syst,
+                               [](const auto& alias, const ISyst* s)
+                               { return std::less<const ISyst*>()(alias.first, s); });
+    if (it == fSystAliases.end() || it->first != syst) return syst;
+    return it->second;
+  } // function Sample::SystAlias
+
+  //-------------------------------------------------------------------------
+  SystShifts Sample::Shifts(const SystShifts& shifts) const
+  {
+    PISCES_TIME("Sample::Shifts", GetID());
+    // Nothing to remap, so skip rebuilding the shifts
+    if (fSystAliases.empty()) return shifts;
     SystShifts ret;
+    Shifts(shifts, ret);
+    return ret;
+  } // function Sample::Shifts
+
+  //-------------------------------------------------------------------------
+  void Sample::Shifts(const SystShifts& shifts, SystShifts& ret) const
+  {
+    PISCES_TIME("Sample::ShiftsInto", GetID());
+    // Resetting ret would wipe the input before it's read
+    if (&shifts == &ret) {
+      SystShifts copy = shifts;
+      Shifts(copy, ret);
+      return;
+    }
+    ret.ResetToNominal();
     for (const ISyst* syst : shifts.ActiveSysts()) {
-      if (fSystMap.count(syst)) {
-        if (fSystMap.at(syst)) { // If there's a nullptr here, skip it
-          ret.SetShift(fSystMap.at(syst), shifts.GetShift(syst));
-        }
-      } else {
-        ret.SetShift(syst, shifts.GetShift(syst));
-      }
+      const ISyst* alias = SystAlias(syst);
+      if (!alias) continue; // skip switched-off systs
+      // Keep autodiff shifts as they are, so derivatives survive remapping
+      if (shifts.HasStan(syst)) ret.SetShift(alias, shifts.GetShift<stan::math::var>(syst));
+      else ret.SetShift(alias, shifts.GetShift(syst));
     } // for syst
-    return ret;
-  } // function Sample::GetSystShifts
+  } // function Sample::Shifts
 
   //-------------------------------------------------------------------------
-  std::vector<const ISyst*> Sample::Systs(std::vector<const ISyst*> systs) const
+  std::vector<const ISyst*> Sample::Systs(const std::vector<const ISyst*>& systs) const
   {
     std::vector<const ISyst*> ret;
-    for (const ISyst* syst : systs) {
-      if (!fSystMap.count(syst)) ret.push_back(syst);
-      else if (fSystMap.at(syst)) ret.push_back(fSystMap.at(syst));
-    }
+    ret.reserve(systs.size());
+    for (const ISyst* syst : systs)
+      if (const ISyst* alias = SystAlias(syst)) ret.push_back(alias);
     return ret;
   } // function Sample::Systs
 
+  //-------------------------------------------------------------------------
+  void Sample::EnablePredictionCache(size_t capacity)
+  {
+    if (!capacity) Error("prediction cache capacity must be positive in sample "+Name());
+    fCache = std::make_shared<PredictionCache<Spectrum>>(capacity);
+    fChannelCache = std::make_shared<PredictionCache<Eigen::ArrayXXd>>(capacity);
+    fArrayCache = std::make_shared<PredictionCache<Eigen::ArrayXd>>(capacity);
+    // Rows for channels that don't oscillate get their own LRU, sized to
+    // hold every such channel at as many shifts as the full predictions, so
+    // oscillation steps can't push them out
+    size_t nOscFree = 0;
+    for (const OscChannel& c : AllChannels()) if (!IsOscSensitive(c)) ++nOscFree;
+    fOscFreeChannelCache = std::make_shared<PredictionCache<Eigen::ArrayXd>>(capacity*std::max<size_t>(nOscFree, 1));
+  } // function Sample::EnablePredictionCache
+
+  //-------------------------------------------------------------------------
+  size_t Sample::CacheHits() const
+  {
+    size_t ret = 0;
+    if (fCache) ret += fCache->Hits();
+    if (fChannelCache) ret += fChannelCache->Hits();
+    if (fArrayCache) ret += fArrayCache->Hits();
+    if (fOscFreeChannelCache) ret += fOscFreeChannelCache->Hits();
+    return ret;
+  } // function Sample::CacheHits
+
+  //-------------------------------------------------------------------------
+  size_t Sample::CacheMisses() const
+  {
+    size_t ret = 0;
+    if (fCache) ret += fCache->Misses();
+    if (fChannelCache) ret += fChannelCache->Misses();
+    if (fArrayCache) ret += fArrayCache->Misses();
+    if (fOscFreeChannelCache) ret += fOscFreeChannelCache->Misses();
+    return ret;
+  } // function Sample::CacheMisses
+
+  //-------------------------------------------------------------------------
+  void Sample::ResetCache()
+  {
+    // Copies of this sample share the cache, so replace it rather than
+    // clearing it in case they still hold the old prediction
+    if (fCache) EnablePredictionCache(fCache->Capacity());
+  } // function Sample::ResetCache
+
   //-------------------------------------------------------------------------
   unsigned int Sample::GetID() const
   {
@@ -257,29 +582,29 @@ namespace pisces {
   std::vector<Sample> Sample::All()
   {
     std::vector<Sample> ret;
-    for (const auto& [sel, tmp1] : kSelNames)
-      for (const auto& [pol, tmp2] : kPolNames)
-        for (const auto& [det, tmp3] : kDetNames)
-          ret.push_back(Sample(sel, pol, det));
+    for (const SelectionInfo& sel : kSelInfo)
+      for (const PolarityInfo& pol : kPolInfo)
+        for (const DetectorInfo& det : kDetInfo)
+          ret.push_back(Sample(sel.sel, pol.pol, det.det));
     return ret;
   } // function Sample::All
 
   //-------------------------------------------------------------------------
   bool Sample::IsNC() const
   {
-    return fSel == kNCOld || fSel == kNCRes10 || fSel == kNCRes20 || fSel == kNCRes30;
+    return kSelInfo[fSel].nc;
   } // function Sample::IsNC
 
   //-------------------------------------------------------------------------
   bool Sample::IsNumu() const
   {
-    return fSel == kCCNumu || fSel == kCCNumuQ1 || fSel == kCCNumuQ2 || fSel == kCCNumuQ3 || fSel == kCCNumuQ4;
+    return kSelInfo[fSel].numu;
   } // function Sample::IsNumu
 
   //-------------------------------------------------------------------------
   bool Sample::IsNue() const
   {
-    return fSel == kCCNue;
+    return kSelInfo[fSel].nue;
   } // function Sample::IsNue
 
   //-------------------------------------------------------------------------
@@ -310,7 +635,15 @@ namespace pisces {
   std::shared_ptr<IPrediction> Sample::Prediction() const
   {
     if (!HasPrediction()) Error("prediction not set in sample "+Name());
-    return fPred;
+    return fPred->Get();
   } // function Sample::Prediction
 
+  //-------------------------------------------------------------------------
+  std::shared_ptr<PredictionTensor> Sample::NominalTensor(const SystShifts& shifts) const
+  {
+    std::shared_ptr<PredictionTensor> ret = std::dynamic_pointer_cast<PredictionTensor>(Prediction());
+    if (ret && (shifts.IsNominal() || IsNominal(shifts))) return ret;
+    return nullptr;
+  } // function Sample::NominalTensor
+
 } // namespace pisces
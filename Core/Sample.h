@@ -3,15 +3,22 @@
 #include "CAFAna/Core/Cut.h"
 #include "CAFAna/Core/HistAxis.h"
 #include "CAFAna/Core/Spectrum.h"
+#include "CAFAna/Core/StanTypedefs.h"
 #include "CAFAna/Core/SystShifts.h"
 #include "CAFAna/Prediction/IPrediction.h"
 
-#include <vector>
+#include "Core/OscChannel.h"
+#include "Core/PredictionCache.h"
+#include "Core/PredictionStore.h"
+
+#include <array>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace pisces {
 
-  class OscChannel;
+  class PredictionTensor;
 
   using namespace ana;
 
@@ -40,31 +47,62 @@ namespace pisces {
     // define size of each enum so we can bit shift
     const size_t nBitsSel = 6, nBitsPol = 2, nBitsDet = 2;
 
-    const std::map<Selection, std::pair<std::string, std::string>> kSelNames
-    {
-      { kCCNumu,   { "numusel",    "CC $\\nu_{\\mu}$"    } },
-      { kCCNumuQ1, { "numuq1sel",  "CC $\\nu_{\\mu}$ Q1" } },
-      { kCCNumuQ2, { "numuq2sel",  "CC $\\nu_{\\mu}$ Q2" } },
-      { kCCNumuQ3, { "numuq3sel",  "CC $\\nu_{\\mu}$ Q3" } },
-      { kCCNumuQ4, { "numuq4sel",  "CC $\\nu_{\\mu}$ Q4" } },
-      { kCCNue,    { "nuesel",     "CC $\\nu_{e}$"       } },
-      { kNCOld,    { "ncoldsel",   "NC (old)"            } },
-      { kNCRes10,  { "ncres10sel", "NC (10% res)"        } },
-      { kNCRes20,  { "ncres20sel", "NC (20% res)"        } },
-      { kNCRes30,  { "ncres30sel", "NC (30% res)"        } }
+    /// Compile-time descriptors for each selection, polarity and detector,
+    /// indexed by enum value. The string forms are only used for I/O
+    struct SelectionInfo {
+      Selection        sel;
+      std::string_view name;
+      std::string_view latex;
+      bool             numu;
+      bool             nue;
+      bool             nc;
     };
-
-    const std::map<Polarity, std::pair<std::string, std::string>> kPolNames
-    {
-      { kFHC, { "fhc", "FHC" } },
-      { kRHC, { "rhc", "RHC" } }
+    struct PolarityInfo {
+      Polarity         pol;
+      std::string_view name;
+      std::string_view latex;
+    };
+    struct DetectorInfo {
+      Detector         det;
+      std::string_view name;
+      std::string_view latex;
     };
 
-    const std::map<Detector, std::pair<std::string, std::string>> kDetNames
+    constexpr std::array<SelectionInfo, 10> kSelInfo
+    {{
+      { kCCNumu,   "numusel",    "CC $\\nu_{\\mu}$",    true,  false, false },
+      { kCCNumuQ1, "numuq1sel",  "CC $\\nu_{\\mu}$ Q1", true,  false, false },
+      { kCCNumuQ2, "numuq2sel",  "CC $\\nu_{\\mu}$ Q2", true,  false, false },
+      { kCCNumuQ3, "numuq3sel",  "CC $\\nu_{\\mu}$ Q3", true,  false, false },
+      { kCCNumuQ4, "numuq4sel",  "CC $\\nu_{\\mu}$ Q4", true,  false, false },
+      { kCCNue,    "nuesel",     "CC $\\nu_{e}$",       false, true,  false },
+      { kNCOld,    "ncoldsel",   "NC (old)",            false, false, true  },
+      { kNCRes10,  "ncres10sel", "NC (10% res)",        false, false, true  },
+      { kNCRes20,  "ncres20sel", "NC (20% res)",        false, false, true  },
+      { kNCRes30,  "ncres30sel", "NC (30% res)",        false, false, true  }
+    }};
+
+    constexpr std::array<PolarityInfo, 2> kPolInfo
+    {{
+      { kFHC, "fhc", "FHC" },
+      { kRHC, "rhc", "RHC" }
+    }};
+
+    constexpr std::array<DetectorInfo, 2> kDetInfo
+    {{
+      { kNearDet, "neardet", "ND" },
+      { kFarDet,  "fardet",  "FD" }
+    }};
+
+    // Check each table is indexed by its enum
+    template<class T, size_t N, class F> constexpr bool IndexedBy(const std::array<T, N>& arr, F key)
     {
-      { kNearDet, { "neardet", "ND" } },
-      { kFarDet, { "fardet", "FD" } }
-    };
+      for (size_t i = 0; i < N; ++i) if (size_t(key(arr[i])) != i) return false;
+      return true;
+    }
+    static_assert(IndexedBy(kSelInfo, [](const SelectionInfo& i) { return i.sel; }));
+    static_assert(IndexedBy(kPolInfo, [](const PolarityInfo& i) { return i.pol; }));
+    static_assert(IndexedBy(kDetInfo, [](const DetectorInfo& i) { return i.det; }));
 
   } // anonymous namespace
 
@@ -76,33 +114,62 @@ namespace pisces {
     Sample(Selection s, Polarity p, Detector d);
     Sample(unsigned int id);
 
-    std::string SelStr() const { return kSelNames.at(fSel).first; }
-    std::string PolStr() const { return kPolNames.at(fPol).first; }
-    std::string DetStr() const { return kDetNames.at(fDet).first; }
+    std::string SelStr() const { return std::string(kSelInfo[fSel].name); }
+    std::string PolStr() const { return std::string(kPolInfo[fPol].name); }
+    std::string DetStr() const { return std::string(kDetInfo[fDet].name); }
 
     std::string Name() const { return SelStr()+" "+PolStr()+" "+DetStr(); }
     std::string Tag() const { return SelStr()+"_"+PolStr()+"_"+DetStr(); }
     std::string LatexName() const
     {
       std::stringstream oss;
-      oss << kSelNames.at(fSel).second << " "
-          << kPolNames.at(fPol).second << " "
-          << kDetNames.at(fDet).second;
+      oss << kSelInfo[fSel].latex << " "
+          << kPolInfo[fPol].latex << " "
+          << kDetInfo[fDet].latex;
       return oss.str();
     }
 
-    void SetAxis(HistAxis a)   { fAxis     = a; }
-    void SetCut(Cut c)         { fCut      = c; }
-    void SetPOT(double d)      { fPOT      = d; }
-    void SetLivetime(double l) { fLivetime = l; }
-
-    void SetPrediction(std::unique_ptr<IPrediction>& p) { fPred = std::move(p); }
+    // Anything predictions are binned or scaled by drops cached predictions
+    void SetAxis(HistAxis a)   { fAxis     = a; ResetCache(); }
+    void SetCut(Cut c)         { fCut      = c; ResetCache(); }
+    void SetPOT(double d)      { fPOT      = d; ResetCache(); }
+    void SetLivetime(double l) { fLivetime = l; ResetCache(); }
+
+    void SetPrediction(std::unique_ptr<IPrediction>& p);
+    /// Register a prediction that's only loaded on first use, and may be
+    /// evicted again by the PredictionStore when over its memory budget
+    void SetPrediction(std::shared_ptr<PredictionHandle> h);
+    void SetPrediction(const std::string& fname, const std::string& label, size_t bytes);
     void SetCosmic(Spectrum s) { fCosmic = s; }
-    void SetData(Spectrum s)   { fData   = s; }
+    void SetData(Spectrum s)   { fData   = s; ResetCache(); } // predictions follow the data POT
 
-    void SetSystAlias(const ISyst* key, const ISyst* val) { fSystMap[key] = val; }
+    /// Replace key with val when remapping shifts. A null val drops key
+    void SetSystAlias(const ISyst* key, const ISyst* val);
     void SetAuxiliary(bool val) { fIsAux = val; };
 
+    /// Whether predictions depend on the oscillation parameters at all.
+    /// Every sample is sensitive by default. Turning it off (eg for a near
+    /// detector sample fit without sterile or non-standard oscillations)
+    /// lets cached predictions survive oscillation steps, but the
+    /// calculator is then ignored for cached results, so only do it when
+    /// the predictions really don't depend on it. This is all or nothing: a
+    /// sensitive sample is keyed on the hash of every oscillation
+    /// parameter, so a step in any of them misses
+    void SetOscSensitive(bool val) { fOscSensitive = val; ResetCache(); };
+    bool IsOscSensitive() const { return fOscSensitive; };
+    /// Whether channel c of this sample depends on the oscillation parameters
+    bool IsOscSensitive(const OscChannel& c) const { return fOscSensitive && c.Curr() != Current::kNC; };
+    /// Restrict the systs this sample's predictions depend on, so shifts in
+    /// any other syst don't invalidate cached predictions. Given in terms of
+    /// the original systs, and remapped through any aliases. An empty list
+    /// means every syst matters
+    void SetSystDependencies(const std::vector<const ISyst*>& systs);
+    /// Whether predictions depend on this (already alias-remapped) syst
+    bool DependsOn(const ISyst* syst) const;
+    /// Whether the prediction at these shifts is the nominal one, because
+    /// no shifted syst survives remapping or is one this sample depends on
+    bool IsNominal(const SystShifts& shifts) const;
+
     Selection Sel() const { return fSel; }
     Polarity  Pol() const { return fPol; }
     Detector  Det() const { return fDet; }
@@ -114,11 +181,17 @@ namespace pisces {
     double         POT()        const;
     double         Livetime()   const;
 
-    std::vector<OscChannel> AllChannels() const;
+    /// Oscillation channels present in this sample, which are fixed per detector
+    const std::vector<OscChannel>& AllChannels() const;
     bool IsSignal(const OscChannel& c) const;
     std::vector<OscChannel> SignalChannels() const;
     std::vector<OscChannel> BackgroundChannels() const;
 
+    /// The const prediction methods below are reentrant, and safe to call on
+    /// one Sample from many threads at once, provided each thread passes its
+    /// own calculator (see OscCalcPool) and the prediction's own const
+    /// methods are thread-safe. Lazy loading and the prediction caches lock
+    /// internally. The setters are not safe to call concurrently with them
     Spectrum Predict(osc::IOscCalc* calc,
                      const SystShifts& shifts=kNoShift) const;
     Spectrum PredictComponent(Flavors::Flavors_t flav,
@@ -134,23 +207,83 @@ namespace pisces {
     Spectrum PredictBackground(osc::IOscCalc* calc,
                                const SystShifts& shifts=kNoShift) const;
 
+    /// Write bin contents (without underflow and overflow, at this sample's
+    /// POT) into a caller-owned buffer instead of returning a Spectrum. For
+    /// tensor predictions at nominal shifts, with no prediction cache (whose
+    /// keys need remapped shifts), these make no heap allocations
+    void PredictInto(Eigen::Ref<Eigen::ArrayXd> out,
+                     osc::IOscCalc* calc,
+                     const SystShifts& shifts=kNoShift) const;
+    void PredictChannelInto(Eigen::Ref<Eigen::ArrayXd> out,
+                            const OscChannel& channel,
+                            osc::IOscCalc* calc,
+                            const SystShifts& shifts=kNoShift) const;
+    void PredictSignalInto(Eigen::Ref<Eigen::ArrayXd> out,
+                           osc::IOscCalc* calc,
+                           const SystShifts& shifts=kNoShift) const;
+    void PredictBackgroundInto(Eigen::Ref<Eigen::ArrayXd> out,
+                               osc::IOscCalc* calc,
+                               const SystShifts& shifts=kNoShift) const;
+
+    /// Predict every channel in AllChannels() in a single pass. Returns a
+    /// channels x bins array, with rows in the same order as AllChannels()
+    Eigen::ArrayXXd PredictAllChannels(osc::IOscCalc* calc,
+                                       const SystShifts& shifts=kNoShift) const;
+    /// Per-channel weights (1 for signal, 0 for background) matching the rows
+    /// of PredictAllChannels(), for summing signal or background contributions
+    Eigen::ArrayXd SignalMask() const;
+
+    /// Bin contents at this sample's POT as autodiff variables, which carry
+    /// derivatives with respect to the calculator's parameters and any
+    /// shifts set as stan::math::var. Never cached, and never uses the
+    /// tensor backend. Gradients must be taken on the calling thread
+    Eigen::ArrayXstan PredictStan(osc::IOscCalcStan* calc,
+                                  const SystShifts& shifts=kNoShift) const;
+
     Spectrum Data()   const;
     Spectrum Cosmic() const;
 
     Spectrum NewSpectrum(const Eigen::ArrayXd& arr) const;
-
-    SystShifts Shifts(SystShifts shifts) const;
-    std::vector<const ISyst*> Systs(std::vector<const ISyst*> systs) const;
+    Eigen::ArrayXd ToArray(const Spectrum& s) const;
+
+    /// Shifts remapped through the syst aliases. Returns the input unchanged
+    /// when there are no aliases, but otherwise builds a new SystShifts
+    SystShifts Shifts(const SystShifts& shifts) const;
+    /// Remap shifts into ret instead of returning a new object. ret may be
+    /// shifts itself, at the cost of a copy. This is not allocation-free:
+    /// SystShifts::ActiveSysts() builds a vector, and SetShift() inserts
+    /// into ret's maps
+    void Shifts(const SystShifts& shifts, SystShifts& ret) const;
+    std::vector<const ISyst*> Systs(const std::vector<const ISyst*>& systs) const;
+    /// Alias for syst in this sample: syst itself if it has no alias, or
+    /// nullptr if it's switched off
+    const ISyst* SystAlias(const ISyst* syst) const;
+    const std::vector<std::pair<const ISyst*, const ISyst*>>& SystAliases() const { return fSystAliases; }
 
     bool IsAuxiliary() const { return fIsAux; };
 
+    bool HasAxis()       const { return !fAxis.GetLabels().empty();   }
     bool HasPrediction() const { return bool(fPred);                  }
+    bool IsPredictionLoaded() const { return fPred && fPred->IsLoaded(); }
     bool HasData()       const { return fData.NDimensions();          }
     bool HasCosmic()     const { return fCosmic.NDimensions();        }
-    void ResetPrediction()     { fPred.reset();                       }
-    void ResetData()           { fData = Spectrum::Uninitialized();   }
+    void ResetPrediction()     { fPred.reset(); ResetCache();         }
+    /// Free a lazy prediction's memory, keeping it registered for reloading
+    void EvictPrediction()     { if (fPred) fPred->Evict();           }
+    void ResetData()           { fData = Spectrum::Uninitialized(); ResetCache(); }
     void ResetCosmic()         { fCosmic = Spectrum::Uninitialized(); }
 
+    /// Memoize up to capacity predictions, keyed on the oscillation
+    /// parameters and remapped systematic shifts this sample depends on, so
+    /// steps in anything else reuse the previous result. Calculators that
+    /// don't implement GetParamsHash() are only cached for samples that
+    /// aren't oscillation sensitive
+    void EnablePredictionCache(size_t capacity);
+    void DisablePredictionCache() { fCache.reset(); fChannelCache.reset(); fArrayCache.reset(); fOscFreeChannelCache.reset(); }
+    bool HasPredictionCache() const { return bool(fCache); }
+    size_t CacheHits()   const;
+    size_t CacheMisses() const;
+
     unsigned int GetID() const;
     static std::string EnsembleID(const std::vector<Sample>& samples);
     static std::vector<Sample> FromEnsembleID(const std::string& id);
@@ -172,6 +305,34 @@ namespace pisces {
   protected:
 
     std::shared_ptr<IPrediction> Prediction() const;
+    /// Cache key covering only what this sample depends on, given remapped
+    /// shifts. The oscillation part is left empty when osc is false
+    bool MakeKey(osc::IOscCalc* calc, const SystShifts& shifts,
+                 PredictionKey& key, bool osc) const;
+    /// Tensor prediction, if that's what this sample has and the shifts are
+    /// nominal after remapping, or nullptr otherwise
+    std::shared_ptr<PredictionTensor> NominalTensor(const SystShifts& shifts) const;
+    /// Fill weights for the tensor prediction with only channels passing
+    /// keep switched on, and write the result into out
+    template<class F> void PredictTensorInto(const PredictionTensor& tensor,
+                                             Eigen::Ref<Eigen::ArrayXd> out,
+                                             osc::IOscCalc* calc, F keep) const;
+    /// Sum of the channels passing keep. Uses the tensor or a cached
+    /// PredictAllChannels() if there is one, and otherwise predicts only
+    /// the channels wanted
+    template<class F> void SumChannelsInto(Eigen::Ref<Eigen::ArrayXd> out,
+                                           osc::IOscCalc* calc,
+                                           const SystShifts& shifts, F keep) const;
+    /// One channel for already remapped shifts, through the cache of
+    /// channels that don't oscillate where that applies
+    void PredictComponentInto(Eigen::Ref<Eigen::ArrayXd, 0, Eigen::InnerStride<>> out,
+                              const IPrediction& pred, const OscChannel& c,
+                              osc::IOscCalc* calc, const SystShifts& s) const;
+    void ResetCache();
+    /// ID of the channel in AllChannels() matching a component, for keying
+    /// timings, or Instrumentation::kNoChannel if it's a sum of several
+    size_t ComponentID(Flavors::Flavors_t flav, Current::Current_t curr,
+                       Sign::Sign_t sign) const;
 
     Selection fSel;
     Polarity  fPol;
@@ -182,14 +343,27 @@ namespace pisces {
     double   fPOT = -1;
     double   fLivetime = -1;
 
-    std::shared_ptr<IPrediction> fPred;
+    std::shared_ptr<PredictionHandle> fPred;
 
     Spectrum fData = Spectrum::Uninitialized();
     Spectrum fCosmic = Spectrum::Uninitialized();
 
-    std::map<const ISyst*, const ISyst*> fSystMap;
+    /// Syst aliases, kept sorted by key for binary search
+    std::vector<std::pair<const ISyst*, const ISyst*>> fSystAliases;
+
+    std::shared_ptr<PredictionCache<Spectrum>> fCache;
+    std::shared_ptr<PredictionCache<Eigen::ArrayXXd>> fChannelCache;
+    std::shared_ptr<PredictionCache<Eigen::ArrayXd>> fArrayCache;
+    /// Single channel rows, for channels that don't oscillate, keyed on the
+    /// channel rather than the oscillation parameters
+    std::shared_ptr<PredictionCache<Eigen::ArrayXd>> fOscFreeChannelCache;
 
     bool fIsAux = false;
+    bool fOscSensitive = true;
+
+    /// Syst dependencies as given, and remapped through the aliases, sorted
+    std::vector<const ISyst*> fSystDepsRaw;
+    std::vector<const ISyst*> fSystDeps;
 
     friend class Ensemble;
 
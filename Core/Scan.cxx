@@ -0,0 +1,259 @@
+#include "Core/Scan.h"
+#include "Core/Sample.h"
+
+#include "tbb/parallel_for.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+namespace pisces {
+
+  using namespace ana;
+
+  namespace {
+
+    //-------------------------------------------------------------------------
+    /// Every index with 0 <= idx[d] < counts[d], the last axis varying
+    /// fastest
+    std::vector<std::vector<long>> Indices(const std::vector<long>& counts)
+    {
+      std::vector<std::vector<long>> ret;
+      std::vector<long> idx(counts.size(), 0);
+      while (true) {
+        ret.push_back(idx);
+        size_t d = counts.size();
+        for (; d > 0; --d) {
+          if (++idx[d-1] < counts[d-1]) break;
+          idx[d-1] = 0;
+        }
+        if (d == 0) return ret;
+      }
+    } // function Indices
+
+    //-------------------------------------------------------------------------
+    /// origin + step*offset, axis by axis
+    std::vector<long> Shifted(const std::vector<long>& origin,
+                              const std::vector<long>& offset, long step)
+    {
+      std::vector<long> ret = origin;
+      for (size_t d = 0; d < ret.size(); ++d) ret[d] += step*offset[d];
+      return ret;
+    } // function Shifted
+
+  } // anonymous namespace
+
+  //---------------------------------------------------------------------------
+  Scan::Scan(const std::vector<Axis>& axes)
+    : fAxes(axes)
+  {
+    if (fAxes.empty()) Error("scan needs at least one axis");
+    for (const Axis& a : fAxes)
+      if (a.n < 2) Error("scan needs at least two points along each axis");
+  } // Scan constructor
+
+  //---------------------------------------------------------------------------
+  Scan::Scan(const IFitVar* xVar, int nx, double xmin, double xmax,
+             const IFitVar* yVar, int ny, double ymin, double ymax)
+    : Scan({ { xVar, nx, xmin, xmax }, { yVar, ny, ymin, ymax } })
+  {} // Scan constructor
+
+  //---------------------------------------------------------------------------
+  void Scan::SetRefinement(const std::vector<double>& levels, int depth)
+  {
+    if (depth < 0 || depth > 20) Error("scan refinement depth must be between 0 and 20");
+    if (!fValues.empty()) Error("scan refinement must be set before running");
+    fLevels = levels;
+    fDepth = depth;
+  } // function Scan::SetRefinement
+
+  //---------------------------------------------------------------------------
+  void Scan::Run(osc::IOscCalcAdjustable* calc, const ScanObjective& objective,
+                 const SystShifts& seed)
+  {
+    // Open the checkpoint once for the whole run, with the header if it's
+    // new and any partial last line cut off, so new points start on a line
+    // of their own
+    std::ofstream out;
+    if (!fCheckpoint.empty()) {
+      size_t keep = ReadCheckpoint();
+      if (std::filesystem::exists(fCheckpoint)) std::filesystem::resize_file(fCheckpoint, keep);
+      out.open(fCheckpoint, std::ios::app);
+      if (!out) Error("failed to open scan checkpoint "+fCheckpoint);
+      out.precision(17);
+      if (!keep) out << Header() << std::endl;
+    }
+
+    // Coarse grid first
+    long stride = Stride(0);
+    std::vector<long> nPoints, nCells;
+    for (const Axis& a : fAxes) {
+      nPoints.push_back(a.n);
+      nCells.push_back(a.n-1);
+    }
+    std::vector<Key> keys, cells;
+    const std::vector<long> origin(fAxes.size(), 0);
+    for (const Key& idx : Indices(nPoints)) keys.push_back(Shifted(origin, idx, stride));
+    for (const Key& idx : Indices(nCells))  cells.push_back(Shifted(origin, idx, stride));
+    Evaluate(keys, calc, objective, seed, out);
+
+    // Then halve any cells straddling a contour level, level by level. A
+    // cell's corners are its origin plus 0 or 1 steps along each axis, and
+    // halving it needs 0, 1 or 2 half steps
+    const std::vector<Key> corners = Indices(std::vector<long>(fAxes.size(), 2));
+    const std::vector<Key> halves  = Indices(std::vector<long>(fAxes.size(), 3));
+    for (int level = 1; level <= fDepth && !fLevels.empty(); ++level) {
+      long big = Stride(level-1), half = Stride(level);
+      double min = Minimum();
+      std::set<Key> refine;
+      std::vector<Key> next;
+      for (const Key& cell : cells) {
+        std::vector<Key> around;
+        for (const Key& c : corners) around.push_back(Shifted(cell, c, big));
+        if (!Straddles(around, min)) continue;
+        for (const Key& h : halves)  refine.insert(Shifted(cell, h, half));
+        for (const Key& c : corners) next.push_back(Shifted(cell, c, half));
+      } // for cell
+      Evaluate(std::vector<Key>(refine.begin(), refine.end()), calc, objective, seed, out);
+      cells = next;
+    } // for level
+  } // function Scan::Run
+
+  //---------------------------------------------------------------------------
+  std::vector<Scan::Point> Scan::Points() const
+  {
+    std::vector<Point> ret;
+    for (const auto& [key, val] : fValues) {
+      Point p { std::vector<double>(key.size()), val };
+      for (size_t d = 0; d < key.size(); ++d) p.x[d] = Coord(d, key[d]);
+      ret.push_back(p);
+    }
+    return ret;
+  } // function Scan::Points
+
+  //---------------------------------------------------------------------------
+  Eigen::ArrayXXd Scan::Grid() const
+  {
+    if (fAxes.size() > 2) Error("scan grid is only available in one or two dimensions");
+    long nx = fAxes[0].n, ny = fAxes.size() > 1 ? fAxes[1].n : 1;
+    Eigen::ArrayXXd ret(nx, ny);
+    long stride = Stride(0);
+    for (long i = 0; i < nx; ++i) {
+      for (long j = 0; j < ny; ++j) {
+        Key key = fAxes.size() > 1 ? Key { i*stride, j*stride } : Key { i*stride };
+        auto it = fValues.find(key);
+        ret(i, j) = it == fValues.end() ? std::numeric_limits<double>::quiet_NaN() : it->second;
+      }
+    }
+    return ret;
+  } // function Scan::Grid
+
+  //---------------------------------------------------------------------------
+  double Scan::Minimum() const
+  {
+    double ret = std::numeric_limits<double>::infinity();
+    for (const auto& [key, val] : fValues) ret = std::min(ret, val);
+    return ret;
+  } // function Scan::Minimum
+
+  //---------------------------------------------------------------------------
+  double Scan::Coord(size_t d, long i) const
+  {
+    const Axis& a = fAxes[d];
+    return a.min + (a.max-a.min) * i / double((a.n-1) * Stride(0));
+  } // function Scan::Coord
+
+  //---------------------------------------------------------------------------
+  std::string Scan::Header() const
+  {
+    // Unchanged for 2D scans, so their older checkpoints still resume
+    std::ostringstream oss;
+    oss.precision(17);
+    oss << "# pisces scan";
+    for (const Axis& a : fAxes)
+      oss << " " << a.var->ShortName() << " " << a.n << " " << a.min << " " << a.max;
+    oss << " depth " << fDepth;
+    return oss.str();
+  } // function Scan::Header
+
+  //---------------------------------------------------------------------------
+  size_t Scan::ReadCheckpoint()
+  {
+    std::ifstream in(fCheckpoint, std::ios::binary);
+    if (!in) return 0; // nothing to resume from
+    std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    // A job killed mid-write can leave a partial last line, which may still
+    // parse (eg a value cut short), so only lines ending in a newline count
+    size_t end = contents.find('\n');
+    if (end == std::string::npos) return 0;
+    if (contents.substr(0, end) != Header())
+      Error("checkpoint "+fCheckpoint+" was written by a different scan");
+    size_t n = fAxes.size(), pos = end+1;
+    for (; (end = contents.find('\n', pos)) != std::string::npos; pos = end+1) {
+      // Lines are the lattice indices, the coordinates, then the value
+      std::istringstream iss(contents.substr(pos, end-pos));
+      Key key(n);
+      double x, val;
+      bool ok = true;
+      for (size_t d = 0; d < n; ++d) ok = ok && (iss >> key[d]);
+      for (size_t d = 0; d < n; ++d) ok = ok && (iss >> x);
+      if (ok && (iss >> val)) fValues[key] = val;
+    }
+    return pos;
+  } // function Scan::ReadCheckpoint
+
+  //---------------------------------------------------------------------------
+  void Scan::Evaluate(const std::vector<Key>& keys, osc::IOscCalcAdjustable* calc,
+                      const ScanObjective& objective, const SystShifts& seed,
+                      std::ofstream& out)
+  {
+    std::vector<Key> todo;
+    for (const Key& key : keys)
+      if (!fValues.count(key)) todo.push_back(key);
+    if (todo.empty()) return;
+
+    std::mutex mutex;
+
+    std::vector<double> vals(todo.size());
+    tbb::parallel_for(size_t(0), todo.size(), [&](size_t i) {
+      const Key& key = todo[i];
+      std::unique_ptr<osc::IOscCalcAdjustable> c(calc->Copy());
+      for (size_t d = 0; d < fAxes.size(); ++d) fAxes[d].var->SetValue(c.get(), Coord(d, key[d]));
+      SystShifts shifts = seed;
+      vals[i] = objective(c.get(), shifts);
+      if (out.is_open()) {
+        std::ostringstream oss;
+        oss.precision(17);
+        for (long idx : key) oss << idx << " ";
+        for (size_t d = 0; d < fAxes.size(); ++d) oss << Coord(d, key[d]) << " ";
+        oss << vals[i];
+        std::lock_guard<std::mutex> lock(mutex);
+        out << oss.str() << std::endl;
+      }
+    });
+
+    for (size_t i = 0; i < todo.size(); ++i) fValues[todo[i]] = vals[i];
+  } // function Scan::Evaluate
+
+  //---------------------------------------------------------------------------
+  bool Scan::Straddles(const std::vector<Key>& corners, double min) const
+  {
+    double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+    for (const Key& key : corners) {
+      auto it = fValues.find(key);
+      if (it == fValues.end()) return false;
+      lo = std::min(lo, it->second);
+      hi = std::max(hi, it->second);
+    }
+    for (double level : fLevels)
+      if (lo < min+level && hi >= min+level) return true;
+    return false;
+  } // function Scan::Straddles
+
+} // namespace pisces
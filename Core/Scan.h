@@ -0,0 +1,102 @@
+#pragma once
+
+#include "CAFAna/Core/IFitVar.h"
+#include "CAFAna/Core/SystShifts.h"
+
+#include <Eigen/Dense>
+
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Test statistic evaluated at a single scan point. It's given its own
+  /// copy of the calculator, with the scanned variables already set, and
+  /// may adjust the calculator and shifts (eg by profiling over nuisance
+  /// parameters) before returning
+  typedef std::function<double(osc::IOscCalcAdjustable* calc, SystShifts& shifts)> ScanObjective;
+
+  /// Scan of a test statistic over a grid of oscillation parameters, in
+  /// any number of dimensions. Points are spread over threads, and can be
+  /// streamed to a checkpoint file as they complete so an interrupted scan
+  /// resumes where it left off. Cells that straddle one of the contour
+  /// levels can be refined by repeatedly halving them along every axis, so
+  /// flat regions don't waste points
+  class Scan {
+
+  public:
+
+    /// n points spanning [min, max] inclusive
+    struct Axis { const IFitVar* var; int n; double min; double max; };
+
+    Scan(const std::vector<Axis>& axes);
+    /// 2D scan, with nx and ny points spanning [xmin, xmax] and
+    /// [ymin, ymax] inclusive
+    Scan(const IFitVar* xVar, int nx, double xmin, double xmax,
+         const IFitVar* yVar, int ny, double ymin, double ymax);
+
+    /// Append each point to this file as it's evaluated, and skip any
+    /// points the file already holds from a previous run
+    void SetCheckpoint(const std::string& fname) { fCheckpoint = fname; };
+
+    /// Halve cells whose corners straddle minimum+level for any of the
+    /// levels (eg 2.3, 6.18 for 1 and 2 sigma), up to depth times. Each
+    /// refined cell costs up to 3^N - 2^N new points in N dimensions
+    void SetRefinement(const std::vector<double>& levels, int depth);
+
+    /// Evaluate every point. The calculator and shifts are copied for each
+    /// point, so each starts from the same seed
+    void Run(osc::IOscCalcAdjustable* calc, const ScanObjective& objective,
+             const SystShifts& seed=kNoShift);
+
+    /// Coordinates in the order the axes were given
+    struct Point { std::vector<double> x; double value; };
+
+    size_t NDimensions() const { return fAxes.size(); };
+    /// Every evaluated point, including refinements, ordered by the first
+    /// coordinate, then the second and so on
+    std::vector<Point> Points() const;
+    /// Values on the coarse nx x ny grid of a 2D scan, or nx x 1 in 1D.
+    /// Use Points() for more dimensions
+    Eigen::ArrayXXd Grid() const;
+    /// Smallest value found
+    double Minimum() const;
+
+  protected:
+
+    /// Points live on an integer lattice at the finest refinement spacing,
+    /// one index per axis
+    typedef std::vector<long> Key;
+
+    /// Coordinate along axis d at lattice index i
+    double Coord(size_t d, long i) const;
+    long Stride(int level) const { return 1L << (fDepth - level); };
+
+    std::string Header() const;
+    /// Load points from the checkpoint. Returns the length of its complete
+    /// lines, or zero if it has no header yet
+    size_t ReadCheckpoint();
+    /// Evaluate the keys not already known, appending them to out if it's
+    /// open
+    void Evaluate(const std::vector<Key>& keys, osc::IOscCalcAdjustable* calc,
+                  const ScanObjective& objective, const SystShifts& seed,
+                  std::ofstream& out);
+    /// Whether the values at these corners straddle any level above min
+    bool Straddles(const std::vector<Key>& corners, double min) const;
+
+    std::vector<Axis> fAxes;
+
+    std::vector<double> fLevels;
+    int fDepth = 0;
+
+    std::string fCheckpoint;
+    std::map<Key, double> fValues;
+
+  }; // class Scan
+
+} // namespace pisces
@@ -0,0 +1,241 @@
+#include "Core/Snapshot.h"
+
+#include "CAFAna/Core/Registry.h"
+#include "CAFAna/Core/Var.h"
+
+#include <cstring>
+#include <fstream>
+
+namespace pisces {
+
+  using namespace ana;
+  using namespace snapshot;
+
+  //---------------------------------------------------------------------------
+  void SnapshotWriter::Add(const Sample& s)
+  {
+    for (const SampleEntry& e : fSamples)
+      if (e.id == s.GetID()) Error("sample "+s.Name()+" already added to snapshot");
+
+    SampleEntry entry { s.GetID(), size_t(s.GetBinning().NBins()), s.POT(),
+                        s.Livetime(), s.GetAxis().GetLabels().at(0), "" };
+    // Store aliases as null-terminated pairs of short names, with an empty
+    // name standing in for a switched-off syst
+    for (const auto& [key, val] : s.SystAliases()) {
+      entry.aliases += key->ShortName() + '\0';
+      entry.aliases += (val ? val->ShortName() : std::string()) + '\0';
+    }
+    fSamples.push_back(entry);
+
+    const std::vector<double>& edges = s.GetBinning().Edges();
+    AddTensor(s, "edges", Eigen::Map<const Eigen::ArrayXd>(edges.data(), edges.size()));
+    if (s.HasData())
+      AddTensor(s, "data", s.ToArray(s.Data()));
+    if (s.HasCosmic())
+      AddTensor(s, "cosmic", s.Cosmic().GetEigen(s.Livetime(), kLivetime).segment(1, entry.nBins));
+  } // function SnapshotWriter::Add
+
+  //---------------------------------------------------------------------------
+  void SnapshotWriter::Add(const Ensemble& e)
+  {
+    for (const Sample& s : e) Add(s);
+  } // function SnapshotWriter::Add
+
+  //---------------------------------------------------------------------------
+  void SnapshotWriter::AddTensor(const Sample& s, const std::string& name,
+                                 const Eigen::Ref<const Eigen::ArrayXXd>& arr)
+  {
+    bool found = false;
+    for (const SampleEntry& e : fSamples) found |= (e.id == s.GetID());
+    if (!found) Error("sample "+s.Name()+" must be added to snapshot before its tensors");
+    for (const TensorEntry& t : fTensors)
+      if (t.id == s.GetID() && t.name == name)
+        Error("tensor "+name+" already added to snapshot for sample "+s.Name());
+    fTensors.push_back({ s.GetID(), name, arr });
+  } // function SnapshotWriter::AddTensor
+
+  //---------------------------------------------------------------------------
+  void SnapshotWriter::Write(const std::string& fname) const
+  {
+    std::vector<SampleRecord> samples;
+    std::vector<TensorRecord> tensors;
+    std::string blob;
+
+    size_t offset = sizeof(FileHeader) + fSamples.size()*sizeof(SampleRecord)
+      + fTensors.size()*sizeof(TensorRecord);
+    auto addString = [&blob, &offset](const std::string& str, uint64_t& off, uint64_t& size) {
+      off = offset + blob.size();
+      size = str.size();
+      blob += str;
+    };
+
+    for (const SampleEntry& e : fSamples) {
+      SampleRecord rec { e.id, uint32_t(e.nBins), e.pot, e.livetime, 0, 0, 0, 0 };
+      addString(e.label, rec.labelOffset, rec.labelSize);
+      addString(e.aliases, rec.aliasOffset, rec.aliasSize);
+      samples.push_back(rec);
+    }
+    for (const TensorEntry& t : fTensors) {
+      TensorRecord rec { t.id, kFloat64, uint64_t(t.data.rows()), uint64_t(t.data.cols()), 0, 0, 0 };
+      addString(t.name, rec.nameOffset, rec.nameSize);
+      tensors.push_back(rec);
+    }
+
+    // Lay out the tensor data after the blob, each aligned
+    offset += blob.size();
+    for (size_t i = 0; i < fTensors.size(); ++i) {
+      offset = (offset + kAlignment - 1) / kAlignment * kAlignment;
+      tensors[i].offset = offset;
+      offset += fTensors[i].data.size() * sizeof(double);
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.nSamples = fSamples.size();
+    header.nTensors = fTensors.size();
+    header.fileSize = offset;
+
+    std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+    if (!out) Error("failed to open snapshot file "+fname+" for writing");
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)samples.data(), samples.size()*sizeof(SampleRecord));
+    out.write((const char*)tensors.data(), tensors.size()*sizeof(TensorRecord));
+    out.write(blob.data(), blob.size());
+    for (size_t i = 0; i < fTensors.size(); ++i) {
+      while (size_t(out.tellp()) < tensors[i].offset) out.put('\0');
+      out.write((const char*)fTensors[i].data.data(), fTensors[i].data.size()*sizeof(double));
+    }
+    if (!out) Error("failed to write snapshot file "+fname);
+  } // function SnapshotWriter::Write
+
+  //---------------------------------------------------------------------------
+  Snapshot::Snapshot(const std::string& fname)
+    : fFile(std::make_shared<MappedFile>(fname))
+  {
+    const char* data = fFile->Data();
+    size_t size = fFile->Size();
+    if (size < sizeof(FileHeader)) Error("file "+fname+" is too small to be a snapshot");
+    fHeader = (const FileHeader*)data;
+    if (std::memcmp(fHeader->magic, kMagic, sizeof(kMagic)))
+      Error("file "+fname+" is not a snapshot");
+    if (fHeader->version != kVersion)
+      Error("snapshot "+fname+" has version "+std::to_string(fHeader->version)
+            +", expected "+std::to_string(kVersion));
+    if (fHeader->fileSize != size) Error("snapshot "+fname+" is truncated");
+
+    size_t recordsEnd = sizeof(FileHeader) + fHeader->nSamples*sizeof(SampleRecord)
+      + fHeader->nTensors*sizeof(TensorRecord);
+    if (recordsEnd > size) Error("snapshot "+fname+" is corrupt");
+    fSamples = (const SampleRecord*)(data + sizeof(FileHeader));
+    fTensors = (const TensorRecord*)(fSamples + fHeader->nSamples);
+
+    for (uint64_t i = 0; i < fHeader->nTensors; ++i) {
+      const TensorRecord& t = fTensors[i];
+      if (t.type != kFloat64 || t.offset % kAlignment
+          || t.offset + t.rows*t.cols*sizeof(double) > size)
+        Error("snapshot "+fname+" has a corrupt tensor");
+    }
+  } // Snapshot constructor
+
+  //---------------------------------------------------------------------------
+  std::vector<unsigned int> Snapshot::SampleIDs() const
+  {
+    std::vector<unsigned int> ret;
+    for (uint32_t i = 0; i < fHeader->nSamples; ++i)
+      ret.push_back(fSamples[i].id);
+    return ret;
+  } // function Snapshot::SampleIDs
+
+  //---------------------------------------------------------------------------
+  bool Snapshot::HasTensor(const Sample& s, const std::string& name) const
+  {
+    return FindTensor(s.GetID(), name) != nullptr;
+  } // function Snapshot::HasTensor
+
+  //---------------------------------------------------------------------------
+  Eigen::Map<const Eigen::ArrayXXd> Snapshot::Tensor(const Sample& s,
+                                                     const std::string& name) const
+  {
+    const TensorRecord* t = FindTensor(s.GetID(), name);
+    if (!t) Error("tensor "+name+" not found in snapshot for sample "+s.Name());
+    return Eigen::Map<const Eigen::ArrayXXd>((const double*)(fFile->Data() + t->offset),
+                                             t->rows, t->cols);
+  } // function Snapshot::Tensor
+
+  //---------------------------------------------------------------------------
+  void Snapshot::Fill(Sample& s) const
+  {
+    const SampleRecord* rec = Record(s);
+    if (!rec) Error("sample "+s.Name()+" not found in snapshot "+fFile->Name());
+
+    if (s.HasAxis()) {
+      if (size_t(s.GetBinning().NBins()) != rec->nBins)
+        Error("binning of sample "+s.Name()+" doesn't match snapshot "+fFile->Name());
+    } else {
+      Eigen::Map<const Eigen::ArrayXXd> edges = Tensor(s, "edges");
+      std::string name = s.Name();
+      Var var([name](const caf::SRProxy*) -> double {
+        Error("sample "+name+" was restored from a snapshot, so its variable can't be evaluated");
+        return 0;
+      });
+      s.SetAxis(HistAxis(String(rec->labelOffset, rec->labelSize),
+                         Binning::Custom(std::vector<double>(edges.data(), edges.data()+edges.size())),
+                         var));
+    }
+
+    // Exposure comes from the data if present, so clear it first
+    s.ResetData();
+    s.ResetCosmic();
+    s.SetPOT(rec->pot);
+    s.SetLivetime(rec->livetime);
+
+    std::string aliases = String(rec->aliasOffset, rec->aliasSize);
+    for (size_t pos = 0; pos < aliases.size(); ) {
+      std::string key = aliases.c_str() + pos;
+      pos += key.size() + 1;
+      std::string val = aliases.c_str() + pos;
+      pos += val.size() + 1;
+      s.SetSystAlias(Registry<ISyst>::ShortNameToPtr(key),
+                     val.empty() ? nullptr : Registry<ISyst>::ShortNameToPtr(val));
+    }
+
+    if (HasTensor(s, "data"))   s.SetData(s.NewSpectrum(Tensor(s, "data").col(0)));
+    if (HasTensor(s, "cosmic")) s.SetCosmic(s.NewSpectrum(Tensor(s, "cosmic").col(0)));
+  } // function Snapshot::Fill
+
+  //---------------------------------------------------------------------------
+  Ensemble Snapshot::Load() const
+  {
+    std::vector<Sample> samples;
+    for (unsigned int id : SampleIDs()) samples.push_back(Sample(id));
+    Ensemble ret(samples);
+    for (Sample& s : ret) Fill(s);
+    return ret;
+  } // function Snapshot::Load
+
+  //---------------------------------------------------------------------------
+  const SampleRecord* Snapshot::Record(const Sample& s) const
+  {
+    for (uint32_t i = 0; i < fHeader->nSamples; ++i)
+      if (fSamples[i].id == s.GetID()) return &fSamples[i];
+    return nullptr;
+  } // function Snapshot::Record
+
+  //---------------------------------------------------------------------------
+  const TensorRecord* Snapshot::FindTensor(unsigned int id, const std::string& name) const
+  {
+    for (uint64_t i = 0; i < fHeader->nTensors; ++i)
+      if (fTensors[i].sampleID == id && String(fTensors[i].nameOffset, fTensors[i].nameSize) == name)
+        return &fTensors[i];
+    return nullptr;
+  } // function Snapshot::FindTensor
+
+  //---------------------------------------------------------------------------
+  std::string Snapshot::String(uint64_t offset, uint64_t size) const
+  {
+    if (offset + size > fFile->Size()) Error("snapshot "+fFile->Name()+" is corrupt");
+    return std::string(fFile->Data() + offset, size);
+  } // function Snapshot::String
+
+} // namespace pisces
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+#include "Core/MappedFile.h"
+
+#include <Eigen/Dense>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  namespace snapshot {
+
+    const char kMagic[8] = { 'P', 'I', 'S', 'C', 'S', 'N', 'A', 'P' };
+    const uint32_t kVersion = 1;
+
+    /// Tensors are stored column-major, each aligned to this many bytes
+    const size_t kAlignment = 64;
+
+    enum DataType : uint32_t { kFloat64 = 0 };
+
+    // On-disk layout: a FileHeader, nSamples SampleRecords, nTensors
+    // TensorRecords, a blob of strings, then the aligned tensor data.
+    // All offsets are from the start of the file
+    struct FileHeader {
+      char     magic[8];
+      uint32_t version;
+      uint32_t nSamples;
+      uint64_t nTensors;
+      uint64_t fileSize;
+    };
+
+    struct SampleRecord {
+      uint32_t id;
+      uint32_t nBins;
+      double   pot;
+      double   livetime;
+      uint64_t labelOffset;
+      uint64_t labelSize;
+      uint64_t aliasOffset; // pairs of null-terminated syst short names
+      uint64_t aliasSize;
+    };
+
+    struct TensorRecord {
+      uint32_t sampleID;
+      uint32_t type;
+      uint64_t rows;
+      uint64_t cols;
+      uint64_t offset;
+      uint64_t nameOffset;
+      uint64_t nameSize;
+    };
+
+  } // namespace snapshot
+
+  /// Collects samples and tensors, then writes them as a single binary
+  /// snapshot which can be memory-mapped by Snapshot
+  class SnapshotWriter {
+
+  public:
+
+    /// Add a sample's axis, exposure, syst aliases, data and cosmics
+    void Add(const Sample& s);
+    void Add(const Ensemble& e);
+
+    /// Add a named tensor belonging to a sample which has already been added
+    void AddTensor(const Sample& s, const std::string& name,
+                   const Eigen::Ref<const Eigen::ArrayXXd>& arr);
+
+    void Write(const std::string& fname) const;
+
+  protected:
+
+    struct SampleEntry {
+      unsigned int id;
+      size_t       nBins;
+      double       pot;
+      double       livetime;
+      std::string  label;
+      std::string  aliases;
+    };
+
+    struct TensorEntry {
+      unsigned int    id;
+      std::string     name;
+      Eigen::ArrayXXd data;
+    };
+
+    std::vector<SampleEntry> fSamples;
+    std::vector<TensorEntry> fTensors;
+
+  }; // class SnapshotWriter
+
+  /// Read-only view of a binary snapshot. The file is memory-mapped, so
+  /// tensors are returned as zero-copy views, which are only valid for as
+  /// long as the snapshot (or the mapping returned by File()) is alive
+  class Snapshot {
+
+  public:
+
+    Snapshot(const std::string& fname);
+
+    std::vector<unsigned int> SampleIDs() const;
+    bool HasSample(const Sample& s) const { return Record(s) != nullptr; };
+
+    bool HasTensor(const Sample& s, const std::string& name) const;
+    Eigen::Map<const Eigen::ArrayXXd> Tensor(const Sample& s,
+                                             const std::string& name) const;
+
+    /// Restore everything stored for this sample. The axis is only set if
+    /// the sample doesn't already have one, since the variable can't be
+    /// stored: a restored axis can be used for fitting but not for filling
+    void Fill(Sample& s) const;
+    /// Build an ensemble of every sample in the snapshot and fill it
+    Ensemble Load() const;
+
+    std::shared_ptr<const MappedFile> File() const { return fFile; };
+
+  protected:
+
+    const snapshot::SampleRecord* Record(const Sample& s) const;
+    const snapshot::TensorRecord* FindTensor(unsigned int id, const std::string& name) const;
+    std::string String(uint64_t offset, uint64_t size) const;
+
+    std::shared_ptr<const MappedFile> fFile;
+
+    const snapshot::FileHeader*   fHeader;
+    const snapshot::SampleRecord* fSamples;
+    const snapshot::TensorRecord* fTensors;
+
+  }; // class Snapshot
+
+} // namespace pisces
@@ -0,0 +1,183 @@
+#include "Core/StartupLoader.h"
+
+#include "CAFAna/Core/LoadFromFile.h"
+
+#include "TMemFile.h"
+#include "TROOT.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace pisces {
+
+  using namespace ana;
+
+  //---------------------------------------------------------------------------
+  StartupLoader::StartupLoader(Ensemble& ensemble, size_t nIOThreads)
+    : fEnsemble(ensemble), fNIOThreads(nIOThreads), fNextFile(0),
+      fInputs(ensemble.size(), 0), fPending(ensemble.size(), 0),
+      fErrors(ensemble.size())
+  {
+    if (!fNIOThreads) Error("startup loader needs at least one I/O thread");
+  } // StartupLoader constructor
+
+  //---------------------------------------------------------------------------
+  StartupLoader::~StartupLoader() noexcept
+  {
+    // Anyone who cares about failures will have waited already
+    try { WaitAll(); } catch (...) {}
+  } // StartupLoader destructor
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::Add(const Sample& s, Input input, const std::string& fname,
+                          const std::string& label)
+  {
+    if (fStarted) Error("can't add inputs to a startup loader once it's started");
+    size_t i = fEnsemble.Index(s);
+    if (!fReads.count(fname)) fFileOrder.push_back(fname);
+    fReads[fname].push_back({ i, input, label });
+    ++fInputs[i];
+    ++fPending[i];
+  } // function StartupLoader::Add
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::AddManifest(const std::string& fname)
+  {
+    std::ifstream in(fname);
+    if (!in) Error("failed to open startup manifest "+fname);
+    std::string line;
+    while (std::getline(in, line)) {
+      std::istringstream fields(line);
+      std::string tag, input, file, label;
+      if (!(fields >> tag) || tag[0] == '#') continue;
+      if (!(fields >> input >> file >> label))
+        Error("malformed line in startup manifest "+fname+": "+line);
+
+      const Sample* sample = nullptr;
+      for (const Sample& s : fEnsemble) if (s.Tag() == tag) sample = &s;
+      if (!sample) Error("sample "+tag+" in startup manifest "+fname+" isn't in ensemble "+fEnsemble.ID());
+
+      if      (input == "pred")   Add(*sample, kPrediction, file, label);
+      else if (input == "data")   Add(*sample, kData,       file, label);
+      else if (input == "cosmic") Add(*sample, kCosmic,     file, label);
+      else Error("unknown input "+input+" in startup manifest "+fname);
+    }
+  } // function StartupLoader::AddManifest
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::Start()
+  {
+    if (fStarted) Error("startup loader already started");
+    fStarted = true;
+    ROOT::EnableThreadSafety();
+    size_t n = std::min(fNIOThreads, fFileOrder.size());
+    for (size_t i = 0; i < n; ++i) fIOThreads.emplace_back(&StartupLoader::ReadFiles, this);
+  } // function StartupLoader::Start
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::ReadFiles()
+  {
+    for (size_t i = fNextFile++; i < fFileOrder.size(); i = fNextFile++) {
+      const std::string& fname = fFileOrder[i];
+      // Nothing may escape a std::thread, so failures are passed on to
+      // whoever waits for the samples concerned
+      try {
+        std::ifstream in(fname, std::ios::binary | std::ios::ate);
+        if (!in) throw std::runtime_error("failed to open "+fname+" for startup loading");
+        auto bytes = std::make_shared<std::vector<char>>(size_t(in.tellg()));
+        in.seekg(0);
+        if (!in.read(bytes->data(), bytes->size()))
+          throw std::runtime_error("failed to read "+fname+" for startup loading");
+        // Unpacking is CPU-bound, so hand it over and get on with the next read
+        fTasks.run([this, &fname, bytes]() { Deserialise(fname, bytes); });
+      } catch (...) {
+        Fail(fname, std::current_exception());
+      }
+    }
+  } // function StartupLoader::ReadFiles
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::Deserialise(const std::string& fname,
+                                  std::shared_ptr<std::vector<char>> bytes)
+  {
+    try {
+      TMemFile file(fname.c_str(), bytes->data(), bytes->size(), "READ");
+      bytes.reset();
+      for (const Read& r : fReads.at(fname)) {
+        Sample& s = fEnsemble[r.sample];
+        std::unique_ptr<IPrediction> pred;
+        std::unique_ptr<Spectrum> spec;
+        if (r.input == kPrediction) pred = LoadFrom<IPrediction>(&file, r.label);
+        else spec = LoadFrom<Spectrum>(&file, r.label);
+        if (!pred && !spec)
+          throw std::runtime_error("failed to load "+r.label+" from "+fname+" for startup loading");
+
+        std::lock_guard<std::mutex> lock(fMutex);
+        if      (r.input == kPrediction) s.SetPrediction(pred);
+        else if (r.input == kData)       s.SetData(*spec);
+        else                             s.SetCosmic(*spec);
+        if (!--fPending[r.sample]) fReady.notify_all();
+      } // for read
+    } catch (...) {
+      Fail(fname, std::current_exception());
+    }
+  } // function StartupLoader::Deserialise
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::Fail(const std::string& fname, std::exception_ptr error)
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    // Samples already complete had nothing left to come from this file
+    for (const Read& r : fReads.at(fname))
+      if (fPending[r.sample] && !fErrors[r.sample]) fErrors[r.sample] = error;
+    if (!fError) fError = error;
+    fReady.notify_all();
+  } // function StartupLoader::Fail
+
+  //---------------------------------------------------------------------------
+  bool StartupLoader::IsReady(size_t i) const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    return !fPending.at(i);
+  } // function StartupLoader::IsReady
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::Wait(size_t i)
+  {
+    if (!fStarted) Error("startup loader must be started before waiting on it");
+    std::unique_lock<std::mutex> lock(fMutex);
+    fReady.wait(lock, [this, i]() { return !fPending.at(i) || fErrors[i]; });
+    if (fErrors[i]) std::rethrow_exception(fErrors[i]);
+  } // function StartupLoader::Wait
+
+  //---------------------------------------------------------------------------
+  void StartupLoader::WaitAll()
+  {
+    for (std::thread& t : fIOThreads) t.join();
+    fIOThreads.clear();
+    fTasks.wait();
+    std::lock_guard<std::mutex> lock(fMutex);
+    if (fError) std::rethrow_exception(fError);
+  } // function StartupLoader::WaitAll
+
+  //---------------------------------------------------------------------------
+  std::vector<size_t> StartupLoader::Ready() const
+  {
+    std::lock_guard<std::mutex> lock(fMutex);
+    std::vector<size_t> ret;
+    for (size_t i = 0; i < fPending.size(); ++i)
+      if (fInputs[i] && !fPending[i]) ret.push_back(i);
+    return ret;
+  } // function StartupLoader::Ready
+
+  //---------------------------------------------------------------------------
+  Ensemble StartupLoader::ReadyEnsemble() const
+  {
+    std::vector<Sample> samples;
+    for (size_t i : Ready()) samples.push_back(fEnsemble[i]);
+    return Ensemble(samples);
+  } // function StartupLoader::ReadyEnsemble
+
+} // namespace pisces
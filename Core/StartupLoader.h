@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+
+#include "tbb/task_group.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Loads predictions, data and cosmics for an Ensemble concurrently at
+  /// startup. Each distinct file is read into memory once by a bounded pool
+  /// of I/O threads, and deserialised by TBB tasks while other files are
+  /// still being read. A sample is filled as soon as all of its inputs are
+  /// in, so fitting can start on whichever samples are ready. Holds a
+  /// reference to the ensemble, which must outlive it, and which mustn't be
+  /// touched until the loader says it's ready. A failure to read or unpack
+  /// a file marks the samples it was feeding as failed, and is rethrown by
+  /// waiting on any of them, or on everything
+  class StartupLoader {
+
+  public:
+
+    enum Input { kPrediction, kData, kCosmic };
+
+    StartupLoader(Ensemble& ensemble, size_t nIOThreads=4);
+    /// Waits for every outstanding load, ignoring any failures
+    ~StartupLoader() noexcept;
+
+    StartupLoader(const StartupLoader&) = delete;
+    StartupLoader& operator=(const StartupLoader&) = delete;
+
+    /// Load input for sample s from label in a ROOT file
+    void Add(const Sample& s, Input input, const std::string& fname,
+             const std::string& label);
+    /// Add every line of a manifest, each "<sample tag> <pred|data|cosmic>
+    /// <file> <label>". Blank lines and lines starting with # are skipped
+    void AddManifest(const std::string& fname);
+
+    /// Issue every read. Nothing more can be added afterwards
+    void Start();
+
+    /// Whether every input for the ensemble's i-th sample has been filled.
+    /// Samples that failed never become ready
+    bool IsReady(size_t i) const;
+    /// Block until sample i is ready, or until everything is, rethrowing
+    /// the failure if sample i (or for WaitAll, any sample) failed. WaitAll
+    /// must only be called from one thread
+    void Wait(size_t i);
+    void WaitAll();
+
+    /// Indices of the samples filled so far, in ensemble order, leaving out
+    /// samples the loader was given nothing for
+    std::vector<size_t> Ready() const;
+    /// Ensemble of the samples filled so far, to start fitting with
+    Ensemble ReadyEnsemble() const;
+
+  protected:
+
+    struct Read {
+      size_t      sample;
+      Input       input;
+      std::string label;
+    };
+
+    /// Body of each I/O thread: read whole files in order of first use
+    void ReadFiles();
+    /// Unpack every input held in one file's bytes into its sample
+    void Deserialise(const std::string& fname, std::shared_ptr<std::vector<char>> bytes);
+    /// Mark every sample still waiting on fname as failed with error
+    void Fail(const std::string& fname, std::exception_ptr error);
+
+    Ensemble& fEnsemble;
+    size_t fNIOThreads;
+    bool fStarted = false;
+
+    /// Reads grouped by file, with files in order of first use
+    std::vector<std::string> fFileOrder;
+    std::map<std::string, std::vector<Read>> fReads;
+
+    std::atomic<size_t> fNextFile;
+    std::vector<std::thread> fIOThreads;
+    tbb::task_group fTasks;
+
+    /// Inputs added, and still to be filled, per sample
+    std::vector<size_t> fInputs;
+    std::vector<size_t> fPending;
+    /// Failure per sample, or null, and the first failure of all
+    std::vector<std::exception_ptr> fErrors;
+    std::exception_ptr fError;
+    mutable std::mutex fMutex;
+    std::condition_variable fReady;
+
+  }; // class StartupLoader
+
+} // namespace pisces
@@ -0,0 +1,76 @@
+#include "Core/ToyGenerator.h"
+
+#include "tbb/parallel_for.h"
+
+#include <cstdint>
+#include <random>
+
+namespace pisces {
+
+  using namespace ana;
+
+  namespace {
+    /// splitmix64's output function, which scrambles every bit of z
+    uint64_t Mix64(uint64_t z)
+    {
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+    } // function Mix64
+
+    /// Output number n of a splitmix64 stream keyed on seed. The seed is
+    /// mixed first, so neighbouring seeds don't give shifted copies of the
+    /// same stream
+    uint64_t SplitMix64(uint64_t seed, uint64_t n)
+    {
+      return Mix64(Mix64(seed) + (n+1) * 0x9e3779b97f4a7c15ull);
+    } // function SplitMix64
+  } // anonymous namespace
+
+  //---------------------------------------------------------------------------
+  ToyGenerator::ToyGenerator(const Eigen::ArrayXd& expected, uint64_t seed,
+                             ToyFluctuation mode)
+    : fExpected(expected), fSeed(seed), fMode(mode)
+  {
+    if ((fExpected < 0).any()) Error("expected bin contents for toys must be non-negative");
+  } // ToyGenerator constructor
+
+  //---------------------------------------------------------------------------
+  ToyGenerator::ToyGenerator(const Ensemble& ensemble, osc::IOscCalc* calc,
+                             const SystShifts& shifts, uint64_t seed,
+                             ToyFluctuation mode)
+    : ToyGenerator(ensemble.Expected(calc, shifts), seed, mode)
+  {} // ToyGenerator constructor
+
+  //---------------------------------------------------------------------------
+  void ToyGenerator::Generate(Eigen::ArrayXXd& out, size_t nToys, size_t firstToy) const
+  {
+    if (out.rows() != fExpected.size() || size_t(out.cols()) != nToys)
+      out.resize(fExpected.size(), nToys);
+    tbb::parallel_for(size_t(0), nToys, [&](size_t i) {
+      Generate(out.col(i), firstToy+i);
+    });
+  } // function ToyGenerator::Generate
+
+  //---------------------------------------------------------------------------
+  void ToyGenerator::Generate(Eigen::Ref<Eigen::ArrayXd> out, size_t toy) const
+  {
+    if (out.size() != fExpected.size()) Error("toy output has the wrong number of bins");
+
+    // Seeding from a single integer doesn't allocate, unlike a seed_seq
+    std::mt19937_64 rng(SplitMix64(fSeed, toy));
+
+    for (Eigen::Index i = 0; i < fExpected.size(); ++i) {
+      double e = fExpected(i);
+      if (e <= 0) {
+        out(i) = 0;
+      } else if (fMode == kPoissonToys) {
+        // Poisson distributions are cheap to construct, so make one per bin
+        out(i) = std::poisson_distribution<long>(e)(rng);
+      } else {
+        out(i) = std::max(0., std::normal_distribution<double>(e, std::sqrt(e))(rng));
+      }
+    } // for bin
+  } // function ToyGenerator::Generate
+
+} // namespace pisces
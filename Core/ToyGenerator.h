@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+
+#include <Eigen/Dense>
+
+#include <cstdint>
+
+namespace pisces {
+
+  using namespace ana;
+
+  enum ToyFluctuation { kPoissonToys, kGaussianToys };
+
+  /// Generates fluctuated fake-data experiments from a set of expected bin
+  /// contents. Toys are written straight into a caller-owned matrix, one
+  /// column per toy, and can be injected into a PoissonLikelihood with
+  /// SetObserved without building any Spectrum.
+  /// Each toy draws from its own random stream, seeded from the generator
+  /// seed and the toy index, so results don't depend on thread count or
+  /// scheduling and any single toy can be regenerated on its own
+  class ToyGenerator {
+
+  public:
+
+    /// expected holds concatenated bin contents in ensemble order
+    ToyGenerator(const Eigen::ArrayXd& expected, uint64_t seed,
+                 ToyFluctuation mode=kPoissonToys);
+    /// Use the ensemble's prediction plus cosmics as the expectation
+    ToyGenerator(const Ensemble& ensemble, osc::IOscCalc* calc,
+                 const SystShifts& shifts, uint64_t seed,
+                 ToyFluctuation mode=kPoissonToys);
+
+    /// Generate toys firstToy to firstToy+nToys-1 in parallel, into the
+    /// columns of out. out is only reallocated if it's the wrong shape
+    void Generate(Eigen::ArrayXXd& out, size_t nToys, size_t firstToy=0) const;
+
+    /// Generate a single toy into out
+    void Generate(Eigen::Ref<Eigen::ArrayXd> out, size_t toy) const;
+
+    const Eigen::ArrayXd& Expected() const { return fExpected; };
+
+  protected:
+
+    Eigen::ArrayXd fExpected;
+    uint64_t fSeed;
+    ToyFluctuation fMode;
+
+  }; // class ToyGenerator
+
+} // namespace pisces
@@ -0,0 +1,306 @@
+#include "Core/WorkQueue.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+namespace pisces {
+
+  using namespace ana;
+
+  namespace {
+
+    //-------------------------------------------------------------------------
+    std::string HostPID()
+    {
+      char host[256] = {0};
+      if (gethostname(host, sizeof(host)-1) != 0) std::snprintf(host, sizeof(host), "unknown");
+      return std::string(host)+"."+std::to_string(getpid());
+    } // function HostPID
+
+    //-------------------------------------------------------------------------
+    void MakeDir(const std::string& dir)
+    {
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        Error("failed to create work queue directory "+dir);
+    } // function MakeDir
+
+    //-------------------------------------------------------------------------
+    /// Write a file so readers only ever see it complete
+    void WriteAtomic(const std::string& fname, const std::string& contents)
+    {
+      std::string tmp = fname+".tmp."+HostPID();
+      {
+        std::ofstream out(tmp);
+        out << contents;
+        if (!out) Error("failed to write "+tmp);
+      }
+      if (rename(tmp.c_str(), fname.c_str()) != 0) Error("failed to rename "+tmp);
+    } // function WriteAtomic
+
+  } // anonymous namespace
+
+  //---------------------------------------------------------------------------
+  WorkQueue::WorkQueue(const std::string& dir)
+    : fDir(dir)
+  {
+    std::ifstream in(fDir+"/manifest");
+    if (!in) Error("no work queue manifest in "+fDir);
+    std::string key;
+    in >> key >> fEnsembleID;
+    if (key != "ensemble") Error("bad work queue manifest in "+fDir);
+    in >> key >> fNTasks;
+    if (key != "tasks") Error("bad work queue manifest in "+fDir);
+    in >> key;
+    if (key != "config") Error("bad work queue manifest in "+fDir);
+    std::getline(in >> std::ws, fConfig);
+  } // WorkQueue constructor
+
+  //---------------------------------------------------------------------------
+  WorkQueue WorkQueue::Create(const std::string& dir, const std::string& ensembleID,
+                              size_t nTasks, const std::string& config)
+  {
+    if (config.find('\n') != std::string::npos) Error("work queue config must be a single line");
+    for (const std::string& d : { dir, dir+"/locks", dir+"/done", dir+"/shards" })
+      MakeDir(d);
+
+    // Reopening an existing queue is fine, as long as it's the same one
+    if (std::ifstream(dir+"/manifest").good()) {
+      WorkQueue ret(dir);
+      if (ret.fEnsembleID != ensembleID || ret.fNTasks != nTasks || ret.fConfig != config)
+        Error("work queue in "+dir+" was set up for different tasks");
+      return ret;
+    }
+    std::ostringstream oss;
+    oss << "ensemble " << ensembleID << "\ntasks " << nTasks << "\nconfig " << config << "\n";
+    WriteAtomic(dir+"/manifest", oss.str());
+    return WorkQueue(dir);
+  } // function WorkQueue::Create
+
+  //---------------------------------------------------------------------------
+  std::string WorkQueue::LockFile(size_t task) const
+  {
+    return fDir+"/locks/"+std::to_string(task);
+  } // function WorkQueue::LockFile
+
+  //---------------------------------------------------------------------------
+  std::string WorkQueue::DoneFile(size_t task) const
+  {
+    return fDir+"/done/"+std::to_string(task);
+  } // function WorkQueue::DoneFile
+
+  //---------------------------------------------------------------------------
+  std::string WorkQueue::ShardFile() const
+  {
+    // Evaluated per call, so forked workers each get their own shard
+    return fDir+"/shards/"+HostPID();
+  } // function WorkQueue::ShardFile
+
+  //---------------------------------------------------------------------------
+  bool WorkQueue::TryLock(size_t task) const
+  {
+    std::string lock = LockFile(task);
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      // O_EXCL creation is atomic, including on NFS v3 and later
+      int fd = open(lock.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+      if (fd >= 0) {
+        std::string owner = HostPID()+"\n";
+        if (write(fd, owner.data(), owner.size()) < 0) {} // owner is informational only
+        close(fd);
+        return true;
+      }
+      if (errno != EEXIST) Error("failed to create lock "+lock);
+
+      // Held already: take it over only if its owner has stopped touching it
+      struct stat before;
+      if (stat(lock.c_str(), &before) != 0) continue; // just released, try again
+      if (difftime(time(nullptr), before.st_mtime) < fStaleAfter) return false;
+
+      // Move the stale lock aside, which only one worker can do. If the
+      // lock was replaced between stat and rename we've moved a live
+      // lock, so put it back
+      std::string aside = lock+".stale."+HostPID();
+      if (rename(lock.c_str(), aside.c_str()) != 0) return false;
+      struct stat after;
+      if (stat(aside.c_str(), &after) == 0 && after.st_ino != before.st_ino) {
+        if (link(aside.c_str(), lock.c_str()) != 0) {} // lost the race either way
+        unlink(aside.c_str());
+        return false;
+      }
+      unlink(aside.c_str());
+    } // for attempt
+    return false;
+  } // function WorkQueue::TryLock
+
+  //---------------------------------------------------------------------------
+  bool WorkQueue::Claim(size_t& task)
+  {
+    for (size_t i = 0; i < fNTasks; ++i) {
+      size_t t = (fNext + i) % fNTasks;
+      if (IsDone(t) || !TryLock(t)) continue;
+      // Could have finished between checking and locking
+      if (IsDone(t)) {
+        unlink(LockFile(t).c_str());
+        continue;
+      }
+      task = t;
+      fNext = t + 1;
+      return true;
+    } // for task
+    return false;
+  } // function WorkQueue::Claim
+
+  //---------------------------------------------------------------------------
+  void WorkQueue::Heartbeat(size_t task) const
+  {
+    utime(LockFile(task).c_str(), nullptr);
+  } // function WorkQueue::Heartbeat
+
+  //---------------------------------------------------------------------------
+  void WorkQueue::Complete(size_t task, const std::string& result)
+  {
+    if (result.find('\n') != std::string::npos)
+      Error("work queue result for task "+std::to_string(task)+" must be a single line");
+
+    // The result has to be on disk before the task is marked done
+    std::string line = std::to_string(task)+"\t"+result+"\n";
+    std::string shard = ShardFile();
+    int fd = open(shard.c_str(), O_CREAT | O_APPEND | O_WRONLY, 0644);
+    if (fd < 0) Error("failed to open work queue shard "+shard);
+    if (write(fd, line.data(), line.size()) != ssize_t(line.size()) || fsync(fd) != 0)
+      Error("failed to write work queue shard "+shard);
+    close(fd);
+
+    fd = open(DoneFile(task).c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) Error("failed to mark task "+std::to_string(task)+" done");
+    close(fd);
+    unlink(LockFile(task).c_str());
+  } // function WorkQueue::Complete
+
+  //---------------------------------------------------------------------------
+  bool WorkQueue::IsDone(size_t task) const
+  {
+    return access(DoneFile(task).c_str(), F_OK) == 0;
+  } // function WorkQueue::IsDone
+
+  //---------------------------------------------------------------------------
+  size_t WorkQueue::NDone() const
+  {
+    size_t ret = 0;
+    for (size_t t = 0; t < fNTasks; ++t) ret += IsDone(t);
+    return ret;
+  } // function WorkQueue::NDone
+
+  //---------------------------------------------------------------------------
+  size_t WorkQueue::Work(const Task& task)
+  {
+    // Spread workers' starting points so they rarely contend for a lock
+    if (fNTasks) fNext = getpid() % fNTasks;
+    size_t ret = 0, t;
+    while (true) {
+      if (Claim(t)) {
+        Complete(t, task(*this, t));
+        ++ret;
+        continue;
+      }
+      if (NDone() == fNTasks) break;
+      // Everything left is claimed. Wait in case a claim goes stale
+      sleep(1);
+    }
+    return ret;
+  } // function WorkQueue::Work
+
+  //---------------------------------------------------------------------------
+  size_t WorkQueue::RunLocal(size_t nWorkers, const Task& task)
+  {
+    // Fork before this process starts any threads of its own
+    std::fflush(nullptr);
+    std::vector<pid_t> pids;
+    for (size_t i = 0; i < nWorkers; ++i) {
+      pid_t pid = fork();
+      if (pid < 0) Error("failed to fork work queue worker");
+      if (pid == 0) {
+        // Nothing may escape the child, or it would carry on running the
+        // parent's code after RunLocal
+        int status = 0;
+        try {
+          Work(task);
+        } catch (...) {
+          status = 1;
+        }
+        std::fflush(nullptr);
+        _exit(status);
+      }
+      pids.push_back(pid);
+    } // for worker
+
+    size_t ret = 0;
+    for (pid_t pid : pids) {
+      int status;
+      if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ++ret;
+    }
+    return ret;
+  } // function WorkQueue::RunLocal
+
+  //---------------------------------------------------------------------------
+  std::map<size_t, std::string> WorkQueue::Merge() const
+  {
+    std::string dir = fDir+"/shards";
+    DIR* d = opendir(dir.c_str());
+    if (!d) Error("failed to open work queue shards in "+fDir);
+    std::vector<std::string> shards;
+    while (dirent* ent = readdir(d)) {
+      std::string name = ent->d_name;
+      if (name == "." || name == "..") continue;
+      shards.push_back(name);
+    }
+    closedir(d);
+    // Directory order varies between filesystems, so sort for a result
+    // that doesn't
+    std::sort(shards.begin(), shards.end());
+
+    std::map<size_t, std::string> ret;
+    for (const std::string& name : shards) {
+      std::ifstream in(dir+"/"+name, std::ios::binary);
+      std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      // Only take lines which were written out in full, and whose task was
+      // marked done after they were. Anything after the last newline is a
+      // write cut short by a worker dying
+      for (size_t pos = 0, end; (end = contents.find('\n', pos)) != std::string::npos; pos = end+1) {
+        std::string line = contents.substr(pos, end-pos);
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0) continue;
+        char* last;
+        size_t task = std::strtoul(line.c_str(), &last, 10);
+        if (last != line.c_str()+tab || task >= fNTasks || !IsDone(task)) continue;
+        // A task taken over from a stale claim can finish twice, so keep
+        // the first result in shard order
+        ret.emplace(task, line.substr(tab+1));
+      }
+    } // for shard
+    return ret;
+  } // function WorkQueue::Merge
+
+  //---------------------------------------------------------------------------
+  void WorkQueue::Merge(const std::string& fname) const
+  {
+    std::ostringstream oss;
+    for (const auto& [task, result] : Merge()) oss << task << "\t" << result << "\n";
+    WriteAtomic(fname, oss.str());
+  } // function WorkQueue::Merge
+
+} // namespace pisces
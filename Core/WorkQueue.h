@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Core/Ensemble.h"
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace pisces {
+
+  using namespace ana;
+
+  /// Queue of numbered tasks (eg scan points or toy fits) shared through a
+  /// directory, so any process that can see it can take part: workers
+  /// forked locally, or started on other nodes with a shared filesystem.
+  /// A task is claimed by atomically creating a lock file. Workers append
+  /// results to their own shard file, and the shards are merged at the end.
+  /// Claims whose lock hasn't been touched for a while are assumed to
+  /// belong to a dead worker, and are taken over. Layout:
+  ///   dir/manifest       ensemble ID, task count and free-form config
+  ///   dir/locks/<task>   held while a task is in progress
+  ///   dir/done/<task>    created once a task's result is safely written
+  ///   dir/shards/<host>.<pid>
+  class WorkQueue {
+
+  public:
+
+    /// Work for one task, returning its result as a single line of text
+    typedef std::function<std::string(WorkQueue& queue, size_t task)> Task;
+
+    /// Open an existing queue
+    WorkQueue(const std::string& dir);
+
+    /// Set up a new queue for nTasks tasks on the ensemble with this ID
+    static WorkQueue Create(const std::string& dir, const std::string& ensembleID,
+                            size_t nTasks, const std::string& config="");
+
+    const std::string& Dir()        const { return fDir;        };
+    const std::string& EnsembleID() const { return fEnsembleID; };
+    const std::string& Config()     const { return fConfig;     };
+    size_t NTasks() const { return fNTasks; };
+
+    /// Samples for this queue's ensemble, which workers still have to give
+    /// predictions and data
+    Ensemble MakeEnsemble() const { return Ensemble(fEnsembleID); };
+
+    /// Claims untouched for this many seconds are taken to be abandoned
+    void SetStaleAfter(double seconds) { fStaleAfter = seconds; };
+
+    /// Claim the next unfinished task. Returns false once every task is
+    /// either done or held by a live worker
+    bool Claim(size_t& task);
+    /// Refresh our claim on a long-running task so it doesn't look stale
+    void Heartbeat(size_t task) const;
+    /// Record the result for a claimed task and release it
+    void Complete(size_t task, const std::string& result);
+
+    bool IsDone(size_t task) const;
+    size_t NDone() const;
+
+    /// Claim and run tasks until none are left. Returns how many were run
+    size_t Work(const Task& task);
+    /// Fork nWorkers local processes that each call Work, and wait for
+    /// them all. Returns the number of workers that failed, including any
+    /// whose task threw. Must be called before TBB, ROOT or anything else
+    /// has started threads: only the forking thread survives in the
+    /// children, so a pool they inherit would be broken
+    size_t RunLocal(size_t nWorkers, const Task& task);
+
+    /// Results from every shard, keyed by task. Only complete lines for
+    /// tasks marked done are taken, and where a task finished twice the
+    /// result from the first shard in name order wins
+    std::map<size_t, std::string> Merge() const;
+    /// Write merged results to fname, one "task result" line per task
+    void Merge(const std::string& fname) const;
+
+  protected:
+
+    std::string LockFile(size_t task)  const;
+    std::string DoneFile(size_t task)  const;
+    std::string ShardFile()            const;
+    /// Try to create the lock for task, taking it over if it's stale
+    bool TryLock(size_t task) const;
+
+    std::string fDir;
+    std::string fEnsembleID;
+    std::string fConfig;
+    size_t fNTasks = 0;
+    double fStaleAfter = 600;
+
+    /// Where the next claim starts looking, so workers spread out
+    size_t fNext = 0;
+
+  }; // class WorkQueue
+
+} // namespace pisces